@@ -0,0 +1,279 @@
+// Benchmark
+// depends on def.h, syscall.cc, mem.cc, string.cc, time.cc, io.cc, net.cc, zcopy.cc
+// Traffic source, sink and ping-pong modes, so nc
+// can measure a link without external tools.
+
+namespace bench {
+
+enum class Mode : int {
+	kNone,
+	kSource, // write patterned data, never read stdin
+	kSink,   // discard data, never write stdout
+	kPing,   // send a message, time its echo
+	kEcho    // echo messages back to a pinger
+};
+
+enum {
+	kMaxStreams = 0x40,
+	kMaxSize    = 0x100000
+};
+
+// Config
+// Limits of a run; seconds and bytes of zero are unbounded.
+// Bytes counts per stream, size is the write or message size.
+class Config {
+public:
+	Mode mode = Mode::kNone;
+	u64 streams = 1;
+	u64 seconds = 0;
+	u64 bytes = 0;
+	u64 size = 0;
+	bool zerocopy = false;
+};
+
+// mode
+// Looks up a mode by name, kNone if unknown.
+Mode mode(const char *name) {
+	const char *names[] = {"source", "sink", "ping", "echo"};
+	Mode modes[] = {Mode::kSource, Mode::kSink, Mode::kPing, Mode::kEcho};
+	u64 i;
+	for (i = 0; i < sizeof names / sizeof names[0]; i++) {
+		string a = fromNullTermString(name), b = fromNullTermString(names[i]);
+		u64 j;
+		for (j = 0; j < a.len && a.buf[j] == b.buf[j]; j++) {}
+		if (j == a.len && a.len == b.len) return modes[i];
+	}
+	return Mode::kNone;
+}
+
+// Stream
+// Per connection state and counters.
+class Stream {
+public:
+	net::Socket sock;
+	zcopy::Sender zc;
+	u8 *buf = nullptr; // echo buffer
+	u64 bytes = 0;
+	u64 offset = 0;    // progress through the current message
+	u64 pending = 0;   // bytes held for echo
+	u64 sentAt = 0;
+	u64 rounds = 0;
+	u64 rttMin = ~0ull;
+	u64 rttMax = 0;
+	u64 rttSum = 0;
+	bool receiving = false;
+	bool done = false;
+};
+
+namespace {
+Stream streams[kMaxStreams];
+
+// pattern
+// Fills buf with a repeating byte pattern
+// rather than zeros, which links may compress.
+void pattern(u8 *buf, u64 size) {
+	u64 i;
+	for (i = 0; i < size; i++) {
+		buf[i] = static_cast<u8>(i * 0x9b + (i >> 8));
+	}
+}
+
+// putRate
+// Appends bytes over ns as MB/s with two decimals.
+string putRate(string str, u64 bytes, u64 ns) {
+	if (ns == 0) ns = 1;
+	u64 centi = bytes * 100 / (ns / time::kMicrosecond + 1);
+	return formatString(str, dec(centi / 100), '.', dec(centi % 100, 2, '0'), " MB/s");
+}
+
+void report(const Config &c, int n, u64 ns) {
+	char buf[0x2000];
+	string str = newString(buf, sizeof buf);
+	const char *names[] = {"", "source", "sink", "ping", "echo"};
+	u64 total = 0, rounds = 0, sum = 0, lo = ~0ull, hi = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		Stream *s = &streams[i];
+		total += s->bytes;
+		rounds += s->rounds;
+		sum += s->rttSum;
+		if (s->rttMin < lo) lo = s->rttMin;
+		if (s->rttMax > hi) hi = s->rttMax;
+		if (n == 1) continue;
+		str = formatString(str, "stream ", dec(static_cast<u64>(i)), ": ", dec(s->bytes), " bytes, ");
+		str = formatString(putRate(str, s->bytes, ns), '\n');
+	}
+	str = formatString(str, names[static_cast<int>(c.mode)], ": ", dec(static_cast<u64>(n)), n == 1 ? " stream, " : " streams, ");
+	str = formatString(str, dec(total), " bytes in ", dec(ns / time::kMillisecond), " ms, ");
+	str = formatString(putRate(str, total, ns), '\n');
+	if (c.mode == Mode::kPing && rounds > 0) {
+		str = formatString(str, "ping: ", dec(rounds), " round trips, rtt min/avg/max ");
+		str = formatString(str, dec(lo / time::kMicrosecond), '/', dec(sum / rounds / time::kMicrosecond), '/', dec(hi / time::kMicrosecond), " us\n");
+	}
+	writeString(str, kStringFdErr);
+}
+
+// finish
+// Ends a stream's sending; the peer sees end of file
+// and closes, which ends the stream on our side.
+void finish(Stream *s) {
+	s->sock.shutdown(net::Shut::kWrite);
+	s->done = true;
+}
+
+// step
+// Advances a ready stream by one read or write.
+// Returns false once the stream has ended.
+bool step(const Config &c, Stream *s, u8 *data, u8 *scratch) {
+	int fd = s->sock.fd();
+	i64 n;
+	switch (c.mode) {
+	case Mode::kSource: {
+		if (s->done) break;
+		u64 len = c.size;
+		if (c.bytes != 0 && c.bytes - s->bytes < len) len = c.bytes - s->bytes;
+		n = s->zc.send(data, len);
+		if (n < 0) return syscall::err(n) == syscall::kEAgain;
+		s->bytes += static_cast<u64>(n);
+		if (c.bytes != 0 && s->bytes >= c.bytes) finish(s);
+		return true;
+	}
+	case Mode::kSink:
+		break;
+	case Mode::kPing:
+		if (s->done) break;
+		if (!s->receiving) {
+			if (s->offset == 0) s->sentAt = time::now();
+			n = syscall::write(fd, &data[s->offset], c.size - s->offset);
+			if (n < 0) return syscall::err(n) == syscall::kEAgain;
+			s->bytes += static_cast<u64>(n);
+			s->offset += static_cast<u64>(n);
+			if (s->offset == c.size) {
+				s->offset = 0;
+				s->receiving = true;
+			}
+			return true;
+		}
+		n = syscall::read(fd, scratch, c.size - s->offset);
+		if (n <= 0) return n < 0 && syscall::err(n) == syscall::kEAgain;
+		s->offset += static_cast<u64>(n);
+		if (s->offset == c.size) {
+			u64 rtt = time::now() - s->sentAt;
+			s->rounds++;
+			s->rttSum += rtt;
+			if (rtt < s->rttMin) s->rttMin = rtt;
+			if (rtt > s->rttMax) s->rttMax = rtt;
+			s->offset = 0;
+			s->receiving = false;
+			if (c.bytes != 0 && s->bytes >= c.bytes) finish(s);
+		}
+		return true;
+	case Mode::kEcho:
+		if (s->pending > 0) {
+			n = syscall::write(fd, &s->buf[s->offset], s->pending);
+			if (n < 0) return syscall::err(n) == syscall::kEAgain;
+			s->offset += static_cast<u64>(n);
+			s->pending -= static_cast<u64>(n);
+			return true;
+		}
+		n = syscall::read(fd, s->buf, c.size);
+		if (n <= 0) return n < 0 && syscall::err(n) == syscall::kEAgain;
+		s->bytes += static_cast<u64>(n);
+		s->offset = 0;
+		s->pending = static_cast<u64>(n);
+		return true;
+	case Mode::kNone:
+		return false;
+	}
+	// Draining: sinks, and sources or pingers waiting for
+	// their peer to close after they finished.
+	n = syscall::read(fd, scratch, kMaxSize);
+	if (n <= 0) return n < 0 && syscall::err(n) == syscall::kEAgain;
+	if (c.mode == Mode::kSink) s->bytes += static_cast<u64>(n);
+	return true;
+}
+
+i16 events(const Config &c, Stream *s) {
+	if (s->done) return io::kIn;
+	switch (c.mode) {
+	case Mode::kSource: return io::kOut;
+	case Mode::kPing: return s->receiving ? io::kIn : io::kOut;
+	case Mode::kEcho: return s->pending > 0 ? io::kOut : io::kIn;
+	case Mode::kSink:
+	case Mode::kNone: break;
+	}
+	return io::kIn;
+}
+} // namespace
+
+// run
+// Drives n connected sockets in the configured mode
+// until every stream ends, then reports throughput and,
+// for ping, round trip latency on stderr.
+// Returns 0 or the negated errno.
+int run(const Config &c, net::Socket *socks, int n) {
+	if (n > kMaxStreams) n = kMaxStreams;
+	u8 *data = static_cast<u8 *>(mem::pages(kMaxSize));
+	u8 *scratch = static_cast<u8 *>(mem::pages(kMaxSize));
+	if (data == nullptr || scratch == nullptr) return -syscall::kENoMem;
+	pattern(data, kMaxSize);
+
+	int i;
+	for (i = 0; i < n; i++) {
+		streams[i] = Stream();
+		streams[i].sock = socks[i];
+		streams[i].sock.nonBlock();
+		// The pattern never changes, so sends from it
+		// need no completion tracking beyond draining.
+		streams[i].zc = zcopy::Sender(streams[i].sock);
+		if (c.zerocopy && c.mode == Mode::kSource) streams[i].zc.enable();
+		if (c.mode == Mode::kEcho) {
+			streams[i].buf = static_cast<u8 *>(mem::pages(c.size));
+			if (streams[i].buf == nullptr) return -syscall::kENoMem;
+		}
+	}
+
+	u64 start = time::now();
+	u64 deadline = c.seconds != 0 ? start + c.seconds * time::kSecond : 0;
+	int active = n;
+	while (active > 0) {
+		io::PollFd fds[kMaxStreams];
+		Stream *polled[kMaxStreams];
+		int m = 0;
+		for (i = 0; i < n; i++) {
+			Stream *s = &streams[i];
+			if (!s->sock.ok()) continue;
+			polled[m] = s;
+			fds[m++] = io::PollFd{s->sock.fd(), events(c, s), 0};
+		}
+
+		int timeout = -1;
+		if (deadline != 0) {
+			u64 now = time::now();
+			timeout = now >= deadline ? 0 : static_cast<int>((deadline - now) / time::kMillisecond + 1);
+		}
+		int r = io::poll(fds, static_cast<u64>(m), timeout);
+		if (r < 0 && syscall::err(r) != syscall::kEIntr) return r;
+
+		if (deadline != 0 && time::now() >= deadline) {
+			for (i = 0; i < m; i++) {
+				if (!polled[i]->done) finish(polled[i]);
+			}
+			deadline = 0;
+		}
+
+		for (i = 0; i < m; i++) {
+			if (fds[i].revents == 0) continue;
+			if ((fds[i].revents & io::kErr) && polled[i]->zc.enabled()) polled[i]->zc.reap();
+			if (!step(c, polled[i], data, scratch)) {
+				polled[i]->sock.close();
+				active--;
+			}
+		}
+	}
+
+	report(c, n, time::now() - start);
+	return 0;
+}
+
+} // namespace bench
@@ -0,0 +1,408 @@
+// Broker
+// depends on def.h, syscall.cc, mem.cc, string.cc, time.cc, io.cc, net.cc
+// Fan-out server: what stdin or any client sends goes to every
+// other client. Data is held once, in a list of refcounted
+// chunks that is the stream itself, and each client only keeps
+// its place in it; a read is one copy into a chunk followed by
+// a writev per client, however many clients there are. A client
+// that falls more than the queue limit behind holds back every
+// sender until it catches up, and is evicted if it does not
+// within kStall.
+
+namespace broker {
+
+enum {
+	kMaxClients = 0x2000,
+	kChunkSize  = 0x10000,
+	kIov        = 0x40, // chunks gathered per writev
+	kEvents     = 0x100,
+	kPoolMax    = 0x40, // free chunks kept for reuse
+	kTick       = 100   // milliseconds between eviction checks
+};
+
+enum : u64 {
+	kStall = time::kSecond // how long a client may hold senders back
+};
+
+// Config
+// Bytes a client may fall behind before it holds back
+// senders, and whether to report clients coming and going.
+class Config {
+public:
+	u64 queue = 0x400000;
+	bool verbose = false;
+};
+
+namespace {
+enum : u64 {
+	kStdin   = kMaxClients, // event data besides client indexes
+	kListen  = kMaxClients + 1,
+	kReaders = kMaxClients + 2
+};
+
+// Chunk
+// A run of the stream from one sender, followed by its data.
+struct Chunk {
+	Chunk *next; // later data, null for the tail
+	int refs;    // clients yet to pass it
+	int from;    // sender, a client index or kStdin
+	u64 len;
+
+	u8 *data() { return reinterpret_cast<u8 *>(this + 1); }
+};
+
+enum : u64 {
+	kCapacity = kChunkSize - sizeof(Chunk)
+};
+
+// Client
+// A connection and its place in the stream. Its own data
+// is skipped, and is not counted in queued.
+struct Client {
+	net::Socket sock;
+	Chunk *at;     // chunk being written
+	u64 off;       // bytes of it written
+	u64 queued;    // bytes left to write
+	u64 behind;    // when queued went over the limit, 0 if not
+	bool open;
+	bool reading;  // still sending to us
+	bool armed;    // waiting for room to write
+};
+
+// Broker
+// Stream, clients and the two epoll sets: one for the
+// listener, the readers set and clients' room to write;
+// one for data to read, taken out of the first while a
+// client holds senders back.
+class Broker {
+public:
+	int init(const Config &c, net::Socket listener, int in);
+	int run();
+private:
+	Chunk *get();
+	void put(Chunk *k);
+	void release(Chunk *k);
+	int read(int fd, int from);
+	int flush(int i);
+	void advance(int i, u64 n);
+	void check(int i);
+	void accept();
+	void drop(int i, const char *why);
+	void say(const char *what, u64 n, const char *unit);
+
+	Config c_;
+	net::Socket listener_;
+	int in_ = -1;
+	bool inFile_ = false; // stdin is a file, which epoll refuses
+	io::Epoll main_;
+	io::Epoll readers_;
+	bool paused_ = false;
+	Chunk *tail_ = nullptr;
+	Chunk *pool_ = nullptr;
+	int pooled_ = 0;
+	Client *clients_ = nullptr;
+	int top_ = 0;      // slots in use are below top
+	int count_ = 0;
+	int stalled_ = 0;  // clients over the limit
+	int *free_ = nullptr;
+	int freed_ = 0;
+	int dead_[kEvents]; // slots dropped this round, freed after it
+	int deaths_ = 0;
+};
+
+int Broker::init(const Config &c, net::Socket listener, int in) {
+	c_ = c;
+	listener_ = listener;
+	in_ = in;
+	clients_ = static_cast<Client *>(mem::pages(kMaxClients * sizeof(Client)));
+	free_ = static_cast<int *>(mem::pages(kMaxClients * sizeof(int)));
+	if (clients_ == nullptr || free_ == nullptr) return -syscall::kENoMem;
+	tail_ = get();
+	if (tail_ == nullptr) return -syscall::kENoMem;
+	tail_->from = static_cast<int>(kStdin);
+	int err = listener_.nonBlock();
+	if (err == 0) err = main_.open();
+	if (err == 0) err = readers_.open();
+	if (err == 0) err = main_.add(listener_.fd(), io::kIn, kListen);
+	if (err < 0) return err;
+	err = readers_.add(in_, io::kIn, kStdin);
+	if (syscall::err(err) == syscall::kEPerm) inFile_ = true;
+	else if (err < 0) return err;
+	return main_.add(readers_.fd(), io::kIn, kReaders);
+}
+
+// get, put
+// Take chunks from and return them to the pool.
+
+Chunk *Broker::get() {
+	Chunk *k = pool_;
+	if (k != nullptr) {
+		pool_ = k->next;
+		pooled_--;
+	} else {
+		k = static_cast<Chunk *>(mem::pages(kChunkSize));
+		if (k == nullptr) return nullptr;
+	}
+	*k = Chunk{nullptr, 0, 0, 0};
+	return k;
+}
+
+void Broker::put(Chunk *k) {
+	if (pooled_ == kPoolMax) {
+		mem::MMap::unmap(k, kChunkSize);
+		return;
+	}
+	k->next = pool_;
+	pool_ = k;
+	pooled_++;
+}
+
+// release
+// Drops a client's hold on k. The tail stays, as
+// clients joining later start from it.
+void Broker::release(Chunk *k) {
+	if (--k->refs == 0 && k != tail_) put(k);
+}
+
+// say
+// Reports a client coming or going on stderr.
+void Broker::say(const char *what, u64 n, const char *unit) {
+	char buf[0x80];
+	string str = newString(buf, sizeof buf);
+	str = formatString(str, "nc: ", what, ", ", dec(n), ' ', unit, '\n');
+	writeString(str, kStringFdErr);
+}
+
+// read
+// Reads from fd onto the end of the stream, then writes
+// it to every other client with room for it. Returns bytes
+// read, 0 at end of file or the negated errno.
+int Broker::read(int fd, int from) {
+	Chunk *k = tail_;
+	// A sender's reads share a chunk until it fills.
+	bool fresh = k->from != from || k->len == kCapacity;
+	if (fresh && (k = get()) == nullptr) return -syscall::kENoMem;
+	i64 n = syscall::read(fd, &k->data()[k->len], kCapacity - k->len);
+	if (n <= 0) {
+		if (fresh) put(k);
+		return syscall::err(n) == syscall::kEAgain ? 1 : static_cast<int>(n);
+	}
+	k->len += static_cast<u64>(n);
+	if (fresh) {
+		// Every client passes it, the sender skipping it.
+		k->from = from;
+		k->refs = count_;
+		tail_->next = k;
+		if (tail_->refs == 0) put(tail_);
+		tail_ = k;
+		// The sender has nothing to write from it, so moves
+		// past its own chunks now rather than hold them.
+		if (from < kMaxClients) advance(from, 0);
+	}
+	int i;
+	for (i = 0; i < top_; i++) {
+		Client *c = &clients_[i];
+		if (!c->open || i == from) continue;
+		c->queued += static_cast<u64>(n);
+		if (!c->armed && flush(i) < 0) drop(i, "dropped a client");
+		else check(i);
+	}
+	return static_cast<int>(n);
+}
+
+// advance
+// Moves client i on by n written bytes, skipping its
+// own data and letting go of chunks it has passed.
+void Broker::advance(int i, u64 n) {
+	Client *c = &clients_[i];
+	c->queued -= n;
+	for (;;) {
+		Chunk *k = c->at;
+		if (k->from == i) {
+			c->off = k->len;
+		} else {
+			u64 m = n < k->len - c->off ? n : k->len - c->off;
+			c->off += m;
+			n -= m;
+			if (c->off < k->len) return;
+		}
+		// The tail may still grow.
+		if (k->next == nullptr) return;
+		c->at = k->next;
+		c->off = 0;
+		release(k);
+	}
+}
+
+// flush
+// Writes what client i has queued until the socket
+// fills, gathering chunks into one writev. Returns 0
+// or the negated errno.
+int Broker::flush(int i) {
+	Client *c = &clients_[i];
+	for (;;) {
+		syscall::IoVec iov[kIov];
+		int n = 0;
+		u64 total = 0, off = c->off;
+		Chunk *k;
+		for (k = c->at; k != nullptr && n < kIov; k = k->next, off = 0) {
+			if (k->from == i || off == k->len) continue;
+			iov[n++] = syscall::IoVec{&k->data()[off], k->len - off};
+			total += k->len - off;
+		}
+		i64 w = n > 0 ? syscall::writev(c->sock.fd(), iov, n) : 0;
+		if (w < 0 && syscall::err(w) != syscall::kEAgain) return static_cast<int>(w);
+		// Even with nothing written, it passes its own chunks.
+		if (w >= 0) advance(i, static_cast<u64>(w));
+		bool full = w < 0 || static_cast<u64>(w) < total;
+		if (full || k == nullptr) {
+			if (full != c->armed) {
+				c->armed = full;
+				return main_.mod(c->sock.fd(), full ? static_cast<uint>(io::kOut) : 0u, static_cast<u64>(i));
+			}
+			return 0;
+		}
+	}
+}
+
+// check
+// Counts client i in or out of the clients holding
+// senders back, by how far behind it is.
+void Broker::check(int i) {
+	Client *c = &clients_[i];
+	if (!c->open) return;
+	bool over = c->queued > c_.queue;
+	if (over && c->behind == 0) {
+		c->behind = time::now();
+		stalled_++;
+	} else if (!over && c->behind != 0) {
+		c->behind = 0;
+		stalled_--;
+	}
+}
+
+// accept
+// Takes every pending connection, joining each
+// at the end of the stream.
+void Broker::accept() {
+	for (;;) {
+		net::Socket s = listener_.accept(static_cast<int>(net::Type::kNonBlock));
+		if (!s.ok()) return;
+		int i = freed_ > 0 ? free_[--freed_] : top_ < kMaxClients ? top_++ : -1;
+		if (i < 0) {
+			s.close();
+			continue;
+		}
+		Client *c = &clients_[i];
+		*c = Client{s, tail_, tail_->len, 0, 0, true, true, false};
+		tail_->refs++;
+		count_++;
+		if (main_.add(s.fd(), 0, static_cast<u64>(i)) < 0 || readers_.add(s.fd(), io::kIn, static_cast<u64>(i)) < 0) {
+			drop(i, "dropped a client");
+			continue;
+		}
+		if (c_.verbose) say("client joined", static_cast<u64>(count_), "clients");
+	}
+}
+
+// drop
+// Closes client i and lets go of its chunks. The slot
+// is reused only after the events at hand are handled.
+void Broker::drop(int i, const char *why) {
+	Client *c = &clients_[i];
+	if (!c->open) return;
+	if (c_.verbose || c->behind != 0) say(why, c->queued, "bytes queued");
+	if (c->behind != 0) stalled_--;
+	Chunk *k = c->at;
+	while (k != nullptr) {
+		Chunk *next = k->next;
+		release(k);
+		k = next;
+	}
+	c->sock.close();
+	c->open = false;
+	count_--;
+	if (deaths_ < kEvents) dead_[deaths_++] = i;
+	else free_[freed_++] = i;
+}
+
+int Broker::run() {
+	bool inOpen = true;
+	for (;;) {
+		// Pausing takes the whole readers set out of the
+		// main one, however many clients are in it.
+		bool pause = stalled_ > 0;
+		if (pause != paused_) {
+			int err = pause ? main_.del(readers_.fd()) : main_.add(readers_.fd(), io::kIn, kReaders);
+			if (err < 0) return err;
+			paused_ = pause;
+		}
+		int timeout = pause ? kTick : inFile_ && inOpen ? 0 : -1;
+		io::Epoll::Event events[kEvents];
+		int n = main_.wait(events, kEvents, timeout);
+		if (n < 0 && syscall::err(n) != syscall::kEIntr) return n;
+		int e;
+		for (e = 0; e < n; e++) {
+			u64 d = events[e].data;
+			if (d == kListen) {
+				accept();
+			} else if (d == kReaders) {
+				io::Epoll::Event ready[kEvents];
+				int m = readers_.wait(ready, kEvents, 0);
+				int r;
+				for (r = 0; r < m && stalled_ == 0; r++) {
+					u64 from = ready[r].data;
+					if (from == kStdin) {
+						if (read(in_, static_cast<int>(kStdin)) <= 0) {
+							readers_.del(in_);
+							inOpen = false;
+						}
+						continue;
+					}
+					Client *c = &clients_[from];
+					if (!c->open || !c->reading) continue;
+					int got = read(c->sock.fd(), static_cast<int>(from));
+					if (got < 0) {
+						drop(static_cast<int>(from), "dropped a client");
+					} else if (got == 0) {
+						// Half closed, it can still listen.
+						c->reading = false;
+						readers_.del(c->sock.fd());
+					}
+				}
+			} else {
+				Client *c = &clients_[d];
+				int i = static_cast<int>(d);
+				if (!c->open) continue;
+				if (events[e].events & (io::kErr | io::kHup)) drop(i, "client left");
+				else if (flush(i) < 0) drop(i, "dropped a client");
+				else check(i);
+			}
+		}
+		if (inFile_ && inOpen && stalled_ == 0 && read(in_, static_cast<int>(kStdin)) <= 0) inOpen = false;
+
+		if (stalled_ > 0) {
+			u64 now = time::now();
+			int i;
+			for (i = 0; i < top_; i++) {
+				Client *c = &clients_[i];
+				if (c->open && c->behind != 0 && now - c->behind > kStall) drop(i, "evicted a slow client");
+			}
+		}
+		while (deaths_ > 0) free_[freed_++] = dead_[--deaths_];
+	}
+}
+} // namespace
+
+// run
+// Serves clients of listener, fanning out stdin and what
+// each of them sends. Runs until killed; returns only the
+// negated errno of a failure.
+int run(const Config &c, net::Socket listener, int in) {
+	Broker b;
+	int err = b.init(c, listener, in);
+	if (err < 0) return err;
+	return b.run();
+}
+
+} // namespace broker
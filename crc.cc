@@ -0,0 +1,180 @@
+// CRC32C
+// depends on def.h
+// Castagnoli CRC of relayed data, as iSCSI and ext4 use it.
+// With SSE4.2 the crc32 instruction runs three independent
+// streams over adjacent blocks, hiding its latency, and the
+// block CRCs are joined by shifting them over the blocks
+// after them with precomputed zeros operators. Without it,
+// tables are consumed eight bytes at a time.
+
+namespace crc {
+
+namespace {
+enum : uint {
+	kPoly = 0x82f63b78 // reflected
+};
+
+enum {
+	kLong  = 0x2000, // interleaved block sizes
+	kShort = 0x100
+};
+
+bool ready = false;
+bool sse42 = false;
+uint table[8][256];      // slicing by 8
+uint longZeros[4][256];  // kLong zero bytes applied to a crc, a byte at a time
+uint shortZeros[4][256];
+
+// GF(2) matrices are 32 column vectors, the
+// operator for appending zero bits to a crc.
+uint times(const uint *mat, uint vec) {
+	uint sum = 0;
+	for (; vec != 0; vec >>= 1, mat++) {
+		if (vec & 1) sum ^= *mat;
+	}
+	return sum;
+}
+
+void square(uint *sq, const uint *mat) {
+	int n;
+	for (n = 0; n < 32; n++) sq[n] = times(mat, mat[n]);
+}
+
+// zerosOp
+// Builds the operator appending len zero bytes,
+// len a power of two.
+void zerosOp(uint *even, u64 len) {
+	uint odd[32];
+	odd[0] = kPoly;
+	int n;
+	for (n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+	square(even, odd); // two zero bits
+	square(odd, even); // four
+	for (;;) {
+		square(even, odd); // a byte, then doubling
+		if ((len >>= 1) == 0) return;
+		square(odd, even);
+		if ((len >>= 1) == 0) break;
+	}
+	for (n = 0; n < 32; n++) even[n] = odd[n];
+}
+
+void zeros(uint out[4][256], u64 len) {
+	uint op[32];
+	zerosOp(op, len);
+	uint n;
+	for (n = 0; n < 256; n++) {
+		out[0][n] = times(op, n);
+		out[1][n] = times(op, n << 8);
+		out[2][n] = times(op, n << 16);
+		out[3][n] = times(op, n << 24);
+	}
+}
+
+inline uint shift(const uint z[4][256], uint crc) {
+	return z[0][crc & 0xff] ^ z[1][(crc >> 8) & 0xff] ^ z[2][(crc >> 16) & 0xff] ^ z[3][crc >> 24];
+}
+
+inline u64 read64(const u8 *p) {
+	u64 v;
+	__builtin_memcpy(&v, p, sizeof v);
+	return v;
+}
+
+// hasSse42
+// cpuid leaf 1 reports SSE4.2 in bit 20 of ecx.
+bool hasSse42() {
+	uint a = 1, b, c = 0, d;
+	__asm__("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+	return (c >> 20) & 1;
+}
+
+uint software(uint crc, const u8 *p, u64 len) {
+	for (; len >= 8; p += 8, len -= 8) {
+		u64 v = read64(p) ^ crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+			table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+			table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+			table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+	}
+	for (; len > 0; p++, len--) crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// blocks
+// Runs three crc streams over adjacent blocks of size
+// bytes and joins them into crc.
+__attribute__((target("sse4.2"))) inline uint blocks(uint crc, const u8 **pp, u64 *len, u64 size, const uint z[4][256]) {
+	const u8 *p = *pp;
+	for (; *len >= 3 * size; *len -= 3 * size) {
+		u64 c0 = crc, c1 = 0, c2 = 0;
+		const u8 *end = p + size;
+		for (; p < end; p += 8) {
+			c0 = __builtin_ia32_crc32di(c0, read64(p));
+			c1 = __builtin_ia32_crc32di(c1, read64(p + size));
+			c2 = __builtin_ia32_crc32di(c2, read64(p + 2 * size));
+		}
+		crc = shift(z, static_cast<uint>(c0)) ^ static_cast<uint>(c1);
+		crc = shift(z, crc) ^ static_cast<uint>(c2);
+		p += 2 * size;
+	}
+	*pp = p;
+	return crc;
+}
+
+__attribute__((target("sse4.2"))) uint hardware(uint crc, const u8 *p, u64 len) {
+	crc = blocks(crc, &p, &len, kLong, longZeros);
+	crc = blocks(crc, &p, &len, kShort, shortZeros);
+	u64 c = crc;
+	for (; len >= 8; p += 8, len -= 8) c = __builtin_ia32_crc32di(c, read64(p));
+	crc = static_cast<uint>(c);
+	for (; len > 0; p++, len--) crc = __builtin_ia32_crc32qi(crc, *p);
+	return crc;
+}
+} // namespace
+
+// init
+// Builds the tables and picks the instruction or
+// table path; call before the first crc32c.
+void init() {
+	if (ready) return;
+	uint n, k;
+	for (n = 0; n < 256; n++) {
+		uint c = n;
+		for (k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ kPoly : c >> 1;
+		table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++) {
+		for (k = 1; k < 8; k++) table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+	}
+	zeros(longZeros, kLong);
+	zeros(shortZeros, kShort);
+	sse42 = hasSse42();
+	ready = true;
+}
+
+// crc32c
+// Continues crc, 0 to start, over len bytes of p.
+uint crc32c(uint crc, const u8 *p, u64 len) {
+	crc = ~crc;
+	crc = sse42 ? hardware(crc, p, len) : software(crc, p, len);
+	return ~crc;
+}
+
+// Sum
+// Running CRC32C and byte count of a stream.
+class Sum {
+public:
+	void update(const u8 *p, u64 len) {
+		crc_ = crc32c(crc_, p, len);
+		bytes_ += len;
+	}
+
+	uint value() const { return crc_; }
+	u64 bytes() const { return bytes_; }
+private:
+	uint crc_ = 0;
+	u64 bytes_ = 0;
+};
+
+} // namespace crc
@@ -0,0 +1,271 @@
+// Disk
+// depends on def.h, syscall.cc, mem.cc, sync.cc, thread.cc, io.cc
+// Receive-to-file writer that keeps out of the page cache.
+// Data gathers in large page aligned buffers, and a second
+// thread writes each full one with O_DIRECT while the next
+// fills, so the socket and the disk work at once. Where the
+// filesystem refuses O_DIRECT the writes go through the cache
+// instead, each buffer pushed to disk with sync_file_range
+// and dropped with POSIX_FADV_DONTNEED once written. The
+// file grows in fallocated extents so it stays in few pieces.
+// A buffer handed over part full, when input pauses, keeps
+// its last partial block to write again with what follows,
+// so writes stay aligned.
+
+namespace disk {
+
+enum : u64 {
+	kBufferSize = 0x400000,  // bytes per write
+	kExtent     = 0x4000000, // bytes preallocated at a time
+	kAlign      = 0x1000     // of O_DIRECT offsets, lengths and memory
+};
+
+enum {
+	kBuffers = 2
+};
+
+namespace {
+enum : int {
+	kKeepSize = 1, // FALLOC_FL_KEEP_SIZE
+	kDontNeed = 4  // POSIX_FADV_DONTNEED
+};
+
+enum : uint {
+	kWaitBefore = 1, // sync_file_range flags
+	kStartWrite = 2,
+	kWaitAfter  = 4
+};
+} // namespace
+
+// Writer
+// Appends to a file from one thread, writing on another.
+class Writer {
+public:
+	// open
+	// Creates or truncates path and starts the writing
+	// thread. Returns 0 or the negated errno.
+	int open(const char *path);
+
+	// space
+	// Returns where the next bytes go, with room
+	// for *len of them, so a read can land there.
+	u8 *space(u64 *len);
+
+	// write
+	// Appends b; bytes already put at space are taken
+	// in place. Returns 0 or the negated errno of this
+	// or an earlier write.
+	int write(const u8 *b, u64 len);
+
+	// pending, flush
+	// Report whether data waits for a buffer to fill, and
+	// hand it to the thread regardless; for when input
+	// pauses. flush returns 0 or the negated errno.
+	bool pending() const;
+	int flush();
+
+	// close
+	// Writes out the rest, trims the file to what was
+	// written and closes it. Returns 0 or the negated errno.
+	int close();
+private:
+	struct Buffer {
+		u8 *data;
+		u64 len;
+		u64 offset; // in the file
+		bool full;  // handed to the thread
+	};
+
+	int hand();
+	int put(Buffer *b);
+	static void loop(void *self);
+
+	int fd_ = -1;
+	bool direct_ = false;
+	Buffer bufs_[kBuffers] = {};
+	int fill_ = 0;  // being filled by the caller
+	int drain_ = 0; // next for the thread to write
+	u64 size_ = 0;      // bytes handed to the thread
+	u64 carried_ = 0;   // of them, at the start of the buffer being filled
+	u64 allocated_ = 0; // bytes preallocated, thread only
+	u64 cached_ = 0;    // start of the cached writes not yet dropped, thread only
+	bool started_ = false;
+	bool closing_ = false;
+	int err_ = 0;       // of the thread
+	sync::Mutex lock_;
+	sync::CondVar filled_;
+	sync::CondVar drained_;
+	thread::Thread thread_;
+};
+
+int Writer::open(const char *path) {
+	int flags = io::kWriteOnly | io::kCreate | io::kTruncate | io::kCloseExec;
+	fd_ = io::open(path, flags | io::kDirect, 0644);
+	direct_ = fd_ >= 0;
+	if (syscall::err(fd_) == syscall::kEInval) fd_ = io::open(path, flags, 0644);
+	if (fd_ < 0) return fd_;
+	int i;
+	for (i = 0; i < kBuffers; i++) {
+		bufs_[i].data = static_cast<u8 *>(mem::pages(kBufferSize));
+		if (bufs_[i].data == nullptr) return -syscall::kENoMem;
+	}
+	int err = thread::init();
+	if (err == 0) err = thread_.start(loop, this);
+	if (err < 0) return err;
+	started_ = true;
+	return 0;
+}
+
+u8 *Writer::space(u64 *len) {
+	Buffer *b = &bufs_[fill_];
+	*len = kBufferSize - b->len;
+	return &b->data[b->len];
+}
+
+int Writer::write(const u8 *b, u64 len) {
+	while (len > 0) {
+		Buffer *f = &bufs_[fill_];
+		u8 *at = &f->data[f->len];
+		u64 n = kBufferSize - f->len < len ? kBufferSize - f->len : len;
+		if (b != at) memcpy(at, b, n);
+		f->len += n;
+		b += n;
+		len -= n;
+		if (f->len == kBufferSize) {
+			int err = hand();
+			if (err < 0) return err;
+		}
+	}
+	return 0;
+}
+
+bool Writer::pending() const {
+	return bufs_[fill_].len > carried_;
+}
+
+int Writer::flush() {
+	return pending() ? hand() : 0;
+}
+
+// hand
+// Passes the buffer being filled to the thread and moves
+// on to the next, waiting for it if still being written.
+int Writer::hand() {
+	sync::Lock l(&lock_);
+	Buffer *f = &bufs_[fill_];
+	u64 len = f->len, tail = len % kAlign;
+	size_ = f->offset + len;
+	f->full = true;
+	filled_.signal();
+	fill_ = (fill_ + 1) % kBuffers;
+	Buffer *next = &bufs_[fill_];
+	while (next->full && err_ == 0) drained_.wait(&lock_);
+	// The thread only writes past len, to pad.
+	memcpy(next->data, &f->data[len - tail], tail);
+	next->offset = size_ - tail;
+	next->len = tail;
+	carried_ = tail;
+	return err_;
+}
+
+// put
+// Writes b out at its offset, preallocating ahead of it.
+// Direct writes are padded out to the alignment, which
+// the next write of the carried block overwrites and close
+// trims off. Cached ones are sent on to disk, after which
+// the ones before them are waited for and dropped.
+int Writer::put(Buffer *b) {
+	u64 end = b->offset + b->len;
+	// Without preallocation the file only ends up in
+	// more pieces, so failing it is not an error. The
+	// size is left alone and close frees the excess; a
+	// killed nc leaves at most the padding of its last
+	// direct write past the data.
+	while (end > allocated_) {
+		if (syscall::fallocate(fd_, kKeepSize, allocated_, kExtent) < 0) allocated_ = ~0ull;
+		else allocated_ += kExtent;
+	}
+	u64 len = b->len, done = 0;
+	if (direct_) {
+		len = (len + kAlign - 1) & ~(kAlign - 1);
+		mem::zero(&b->data[b->len], len - b->len);
+	}
+	while (done < len) {
+		i64 n = syscall::pwrite(fd_, &b->data[done], len - done, b->offset + done);
+		if (n < 0 && syscall::err(n) == syscall::kEIntr) continue;
+		if (n < 0 && syscall::err(n) == syscall::kEInval && direct_ && done == 0) {
+			// Opened but not written to directly; go
+			// through the cache from here on.
+			i64 flags = syscall::fcntl(fd_, syscall::kFcntlGetFlags, 0);
+			if (flags < 0) return static_cast<int>(flags);
+			flags &= ~static_cast<i64>(io::kDirect);
+			i64 r = syscall::fcntl(fd_, syscall::kFcntlSetFlags, static_cast<u64>(flags));
+			if (r < 0) return static_cast<int>(r);
+			direct_ = false;
+			len = b->len;
+			continue;
+		}
+		if (n < 0) return static_cast<int>(n);
+		done += static_cast<u64>(n);
+	}
+	if (!direct_) {
+		syscall::syncFileRange(fd_, b->offset, b->len, kStartWrite);
+		if (b->offset > cached_) {
+			syscall::syncFileRange(fd_, cached_, b->offset - cached_, kWaitBefore | kStartWrite | kWaitAfter);
+			syscall::fadvise(fd_, cached_, b->offset - cached_, kDontNeed);
+			cached_ = b->offset;
+		}
+	}
+	return 0;
+}
+
+// loop
+// Runs on the thread, writing buffers in the order
+// they are handed over until close.
+void Writer::loop(void *self) {
+	Writer *w = static_cast<Writer *>(self);
+	for (;;) {
+		Buffer *b = &w->bufs_[w->drain_];
+		{
+			sync::Lock l(&w->lock_);
+			while (!b->full && !w->closing_) w->filled_.wait(&w->lock_);
+			if (!b->full) return;
+		}
+		int err = w->put(b);
+		sync::Lock l(&w->lock_);
+		b->len = 0;
+		b->full = false;
+		w->drain_ = (w->drain_ + 1) % kBuffers;
+		if (err < 0) w->err_ = err;
+		w->drained_.signal();
+		if (err < 0) return;
+	}
+}
+
+int Writer::close() {
+	if (fd_ < 0) return 0;
+	int err = 0;
+	if (started_) {
+		err = flush();
+		{
+			sync::Lock l(&lock_);
+			closing_ = true;
+			filled_.signal();
+		}
+		thread_.join();
+		started_ = false;
+		if (err == 0) err = err_;
+	}
+	if (!direct_ && err == 0) {
+		syscall::syncFileRange(fd_, cached_, size_ - cached_, kWaitBefore | kStartWrite | kWaitAfter);
+		syscall::fadvise(fd_, cached_, size_ - cached_, kDontNeed);
+	}
+	int r = syscall::ftruncate(fd_, size_);
+	if (err == 0) err = r;
+	r = syscall::close(fd_);
+	if (err == 0) err = r;
+	fd_ = -1;
+	return err;
+}
+
+} // namespace disk
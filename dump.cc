@@ -0,0 +1,193 @@
+// Traffic dump
+// depends on def.h, syscall.cc, mem.cc, string.cc, io.cc
+// Logs relayed data as hex and ASCII columns, 16 bytes a
+// line behind a direction marker and the stream offset:
+//   > 00000010 68 65 6c 6c 6f 0a                               # hello.
+// A line's columns are encoded at once with SSSE3 shuffles
+// where the CPU has them, and lines collect in a large
+// buffer, so logging costs a write per megabyte of text
+// rather than a write per line.
+
+namespace dump {
+
+enum {
+	kLineBytes = 16,
+	kHexAt     = 11,                       // after marker and offset
+	kAsciiAt   = kHexAt + 3 * kLineBytes + 2,
+	kLineSize  = kAsciiAt + kLineBytes + 1, // with the newline
+	kBufSize   = 0x100000
+};
+
+// Direction of a chunk, marked > and <
+enum class Dir : int {
+	kSent,
+	kReceived
+};
+
+namespace {
+typedef char V16 __attribute__((vector_size(16)));
+
+const char digits[] = "0123456789abcdef";
+
+// Shuffles from the high and low digit of each byte and
+// the spaces between them, for each 16 chars of the hex
+// column; a set top bit makes pshufb write a zero.
+char hexHi[3 * kLineBytes];
+char hexLo[3 * kLineBytes];
+char spaces[3 * kLineBytes];
+
+void initShuffles() {
+	int i;
+	for (i = 0; i < 3 * kLineBytes; i++) {
+		hexHi[i] = i % 3 == 0 ? static_cast<char>(i / 3) : static_cast<char>(0x80);
+		hexLo[i] = i % 3 == 1 ? static_cast<char>(i / 3) : static_cast<char>(0x80);
+		spaces[i] = i % 3 == 2 ? ' ' : '\0';
+	}
+}
+
+// hasSsse3
+// cpuid leaf 1 reports SSSE3 in bit 9 of ecx.
+bool hasSsse3() {
+	uint a = 1, b, c = 0, d;
+	__asm__("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+	return (c >> 9) & 1;
+}
+
+// load
+// Unaligned load; -ffreestanding turns off the
+// memcpy builtin, so ask for it by name.
+V16 load(const void *p) {
+	V16 v;
+	__builtin_memcpy(&v, p, sizeof v);
+	return v;
+}
+
+// columnsSsse3
+// Writes the hex and ascii columns of 16 bytes.
+__attribute__((target("ssse3"))) void columnsSsse3(char *line, const u8 *in) {
+	V16 v = load(in);
+	V16 table = load(digits);
+	V16 hi = __builtin_ia32_pshufb128(table, (v >> 4) & 0x0f);
+	V16 lo = __builtin_ia32_pshufb128(table, v & 0x0f);
+	int k;
+	for (k = 0; k < 3; k++) {
+		V16 out = __builtin_ia32_pshufb128(hi, load(&hexHi[16 * k]))
+			| __builtin_ia32_pshufb128(lo, load(&hexLo[16 * k]))
+			| load(&spaces[16 * k]);
+		__builtin_memcpy(&line[kHexAt + 16 * k], &out, sizeof out);
+	}
+	// Bytes above 0x7f are negative, so one signed
+	// range check finds the printable ones.
+	V16 printable = reinterpret_cast<V16>((v > 0x1f) & (v < 0x7f));
+	V16 ascii = (v & printable) | ('.' & ~printable);
+	__builtin_memcpy(&line[kAsciiAt], &ascii, sizeof ascii);
+}
+
+void columns(char *line, const u8 *in) {
+	int i;
+	for (i = 0; i < kLineBytes; i++) {
+		char *h = &line[kHexAt + 3 * i];
+		h[0] = digits[in[i] >> 4];
+		h[1] = digits[in[i] & 0xf];
+		h[2] = ' ';
+		line[kAsciiAt + i] = in[i] >= 0x20 && in[i] < 0x7f ? static_cast<char>(in[i]) : '.';
+	}
+}
+} // namespace
+
+// Log
+// Formats chunks into a buffer that is written to the
+// log descriptor when full and on flush.
+class Log {
+public:
+	// open
+	// Starts logging to fd. Returns 0 or the negated errno.
+	int open(int fd);
+
+	// write
+	// Logs one chunk. Offsets count each direction's bytes.
+	// Returns 0 or the negated errno of writing the log.
+	int write(Dir d, const u8 *buf, u64 len);
+
+	// flush
+	// Writes out buffered lines.
+	int flush();
+
+	bool pending() const;
+private:
+	void line(char marker, u64 offset, const u8 *in, uint n);
+
+	int fd_ = -1;
+	bool ssse3_ = false;
+	char *buf_ = nullptr;
+	u64 len_ = 0;
+	u64 offset_[2] = {0, 0};
+};
+
+int Log::open(int fd) {
+	buf_ = static_cast<char *>(mem::pages(kBufSize));
+	if (buf_ == nullptr) return -syscall::kENoMem;
+	fd_ = fd;
+	ssse3_ = hasSsse3();
+	initShuffles();
+	return 0;
+}
+
+bool Log::pending() const {
+	return len_ > 0;
+}
+
+int Log::flush() {
+	int err = io::writeAll(fd_, reinterpret_cast<u8 *>(buf_), len_);
+	len_ = 0;
+	return err;
+}
+
+// line
+// Appends one line of n bytes. Short lines encode a
+// padded copy and blank the hex columns past n.
+void Log::line(char marker, u64 offset, const u8 *in, uint n) {
+	char *p = &buf_[len_];
+	p[0] = marker;
+	p[1] = ' ';
+	// Offsets past 4G widen the line.
+	uint w = hexLen(offset) > 8 ? hexLen(offset) : 8;
+	memset(&p[2], '0', w);
+	formatHex(&p[2 + w - hexLen(offset)], offset);
+	p += w - 8;
+	p[kHexAt - 1] = ' ';
+
+	u8 tail[kLineBytes];
+	if (n < kLineBytes) {
+		mem::zero(tail, sizeof tail);
+		memcpy(tail, in, n);
+		in = tail;
+	}
+	if (ssse3_) columnsSsse3(p, in);
+	else columns(p, in);
+	if (n < kLineBytes) memset(&p[kHexAt + 3 * n], ' ', 3 * (kLineBytes - n));
+	p[kAsciiAt - 2] = '#';
+	p[kAsciiAt - 1] = ' ';
+	p[kAsciiAt + n] = '\n';
+	len_ = static_cast<u64>(&p[kAsciiAt + n + 1] - buf_);
+}
+
+int Log::write(Dir d, const u8 *buf, u64 len) {
+	u64 *offset = &offset_[static_cast<int>(d)];
+	char marker = d == Dir::kSent ? '>' : '<';
+	while (len > 0) {
+		// Room for the widest line, 64 bit offset included.
+		if (kBufSize - len_ < kLineSize + 8) {
+			int err = flush();
+			if (err < 0) return err;
+		}
+		uint n = static_cast<uint>(len < kLineBytes ? len : static_cast<u64>(kLineBytes));
+		line(marker, *offset, buf, n);
+		buf += n;
+		len -= n;
+		*offset += n;
+	}
+	return 0;
+}
+
+} // namespace dump
@@ -0,0 +1,221 @@
+// Command line flags
+// Inspired by the Go flag package.
+// depends on def.h, string.cc
+// Flags are registered with a pointer to their value,
+// then parse fills the values from argv.
+
+namespace flag {
+
+enum class Kind : int {
+	kBool,
+	kNum,
+	kString
+};
+
+// Flag
+// A registered flag: a short letter, a long name
+// (either may be omitted) and where its value goes.
+class Flag {
+public:
+	char shorthand = '\0';
+	const char *name = nullptr;
+	const char *usage = nullptr;
+	Kind kind = Kind::kBool;
+	void *value = nullptr;
+};
+
+namespace {
+enum { kMaxFlags = 0x40 };
+
+int len = 0;
+Flag flags[kMaxFlags];
+
+void add(Kind kind, void *value, char shorthand, const char *name, const char *usage) {
+	if (len >= kMaxFlags) return;
+	Flag *f = &flags[len++];
+	f->shorthand = shorthand;
+	f->name = name;
+	f->usage = usage;
+	f->kind = kind;
+	f->value = value;
+}
+
+bool equal(const char *a, const char *b, u64 n) {
+	u64 i;
+	for (i = 0; i < n; i++) {
+		if (a[i] != b[i]) return false;
+	}
+	return b[n] == '\0';
+}
+
+Flag *lookupShort(char c) {
+	int i;
+	for (i = 0; i < len; i++) {
+		if (flags[i].shorthand == c) return &flags[i];
+	}
+	return nullptr;
+}
+
+Flag *lookupLong(const char *name, u64 n) {
+	int i;
+	for (i = 0; i < len; i++) {
+		if (flags[i].name != nullptr && equal(name, flags[i].name, n)) return &flags[i];
+	}
+	return nullptr;
+}
+
+void complain(const char *msg, const char *arg) {
+	char buf[0x100];
+	string str = newString(buf, sizeof buf);
+	str = formatString(str, msg, arg, '\n');
+	writeString(str, kStringFdErr);
+}
+} // namespace
+
+// Bool, Num, String
+// Register a flag of the respective type.
+// Num accepts decimal or 0x hex with an optional
+// binary k, m or g suffix.
+void Bool(bool *p, char shorthand, const char *name, const char *usage) {
+	add(Kind::kBool, p, shorthand, name, usage);
+}
+
+void Num(u64 *p, char shorthand, const char *name, const char *usage) {
+	add(Kind::kNum, p, shorthand, name, usage);
+}
+
+void String(const char **p, char shorthand, const char *name, const char *usage) {
+	add(Kind::kString, p, shorthand, name, usage);
+}
+
+// parseNum
+// Parses the Num flag syntax. Fails on numbers
+// that do not fit u64, suffix included.
+bool parseNum(const char *arg, u64 *num) {
+	string str = fromNullTermString(arg);
+	int base = 10;
+	if (str.len > 2 && str.buf[0] == '0' && (str.buf[1] == 'x' || str.buf[1] == 'X')) {
+		base = 16;
+		str = string{&str.buf[2], str.size - 2, str.len - 2};
+	}
+	u64 shift = 0;
+	if (str.len > 1 && base == 10) {
+		switch (str.buf[str.len - 1]) {
+		case 'k': case 'K': shift = 10; break;
+		case 'm': case 'M': shift = 20; break;
+		case 'g': case 'G': shift = 30; break;
+		default: break;
+		}
+		if (shift != 0) str.len--;
+	}
+	if (!stringAsNum(str, num, base)) return false;
+	if (*num > ~0ull >> shift) return false;
+	*num <<= shift;
+	return true;
+}
+
+namespace {
+// set
+// Stores arg in f, arg is null for bools.
+bool set(Flag *f, const char *arg) {
+	switch (f->kind) {
+	case Kind::kBool:
+		*static_cast<bool *>(f->value) = true;
+		return true;
+	case Kind::kNum:
+		if (!parseNum(arg, static_cast<u64 *>(f->value))) {
+			complain("invalid number: ", arg);
+			return false;
+		}
+		return true;
+	case Kind::kString:
+		*static_cast<const char **>(f->value) = arg;
+		return true;
+	}
+	return false;
+}
+} // namespace
+
+// parse
+// Parses flags from argv, which may be given as -a, -abc,
+// -n 1, -n1, --name 1 or --name=1; -- ends the flags.
+// Bools take no value, --name=1 is an error for them.
+// Returns the index of the first argument that is not
+// a flag, or -1 if the flags are malformed.
+int parse(int argc, char **argv) {
+	int i;
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		if (arg[0] != '-' || arg[1] == '\0') break;
+		if (arg[1] == '-') {
+			if (arg[2] == '\0') return i + 1;
+			char *name = &arg[2];
+			u64 n;
+			for (n = 0; name[n] != '\0' && name[n] != '='; n++) {}
+			Flag *f = lookupLong(name, n);
+			if (f == nullptr) {
+				complain("unknown flag: ", arg);
+				return -1;
+			}
+			const char *value = nullptr;
+			if (f->kind == Kind::kBool && name[n] == '=') {
+				complain("flag takes no value: ", arg);
+				return -1;
+			}
+			if (f->kind != Kind::kBool) {
+				if (name[n] == '=') value = &name[n + 1];
+				else if (i + 1 < argc) value = argv[++i];
+				else {
+					complain("missing value: ", arg);
+					return -1;
+				}
+			}
+			if (!set(f, value)) return -1;
+			continue;
+		}
+		char *c;
+		for (c = &arg[1]; *c != '\0'; c++) {
+			Flag *f = lookupShort(*c);
+			if (f == nullptr) {
+				complain("unknown flag: ", arg);
+				return -1;
+			}
+			if (f->kind == Kind::kBool) {
+				set(f, nullptr);
+				continue;
+			}
+			const char *value;
+			if (c[1] != '\0') value = &c[1];
+			else if (i + 1 < argc) value = argv[++i];
+			else {
+				complain("missing value: ", arg);
+				return -1;
+			}
+			if (!set(f, value)) return -1;
+			break;
+		}
+	}
+	return i;
+}
+
+// usage
+// Writes the synopsis and registered flags to stderr.
+void usage(const char *synopsis) {
+	char buf[0x1000];
+	string str = newString(buf, sizeof buf);
+	str = formatString(str, synopsis, '\n');
+	int i;
+	for (i = 0; i < len; i++) {
+		Flag *f = &flags[i];
+		str = formatString(str, "  ");
+		if (f->shorthand != '\0') {
+			str = formatString(str, '-', f->shorthand);
+			if (f->name != nullptr) str = formatString(str, ", ");
+		}
+		if (f->name != nullptr) str = formatString(str, "--", f->name);
+		str = formatString(str, '\t', f->usage, '\n');
+	}
+	writeString(str, kStringFdErr);
+}
+
+} // namespace flag
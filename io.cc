@@ -0,0 +1,119 @@
+// IO
+// depends on def.h, syscall.cc
+// Descriptor helpers shared by the relay and its send paths.
+
+namespace io {
+
+// poll events, which epoll shares
+enum Event : i16 {
+	kIn  = 0x1,
+	kOut = 0x4,
+	kErr = 0x8,
+	kHup = 0x10
+};
+
+typedef syscall::PollFd PollFd;
+
+// open flags
+enum Open : int {
+	kReadOnly  = 0,
+	kWriteOnly = 01,
+	kReadWrite = 02,
+	kCreate    = 0100,
+	kTruncate  = 01000,
+	kDirect    = 040000,
+	kCloseExec = 02000000
+};
+
+// open
+// Opens path relative to the working directory,
+// returns the descriptor or the negated errno.
+int open(const char *path, int flags, int mode) {
+	const int kCwd = -100;
+	return syscall::openat(kCwd, path, flags, mode);
+}
+
+// poll
+// Wraps the poll syscall, timeout in milliseconds
+// or -1 to wait forever.
+int poll(PollFd *fds, u64 n, int timeout) {
+	return syscall::poll(fds, n, timeout);
+}
+
+// writeAll
+// Writes all of buf to fd, retrying short writes.
+// Returns 0 or the negated errno.
+int writeAll(int fd, const u8 *buf, u64 len) {
+	while (len > 0) {
+		i64 n = syscall::write(fd, buf, len);
+		if (n < 0) return static_cast<int>(n);
+		buf += n;
+		len -= static_cast<u64>(n);
+	}
+	return 0;
+}
+
+// Epoll
+// Wraps an epoll instance, see epoll(7). Events are
+// the poll ones; data is handed back as given to add.
+class Epoll {
+public:
+	typedef syscall::EpollEvent Event;
+
+	// open, close, add, mod, del, wait
+	// Return 0, a count for wait, or the negated errno.
+	// wait's timeout is in milliseconds, -1 waits forever.
+	int open();
+	int close();
+	int add(int fd, uint events, u64 data);
+	int mod(int fd, uint events, u64 data);
+	int del(int fd);
+	int wait(Event *events, int n, int timeout);
+
+	// fd
+	// Returns the epoll descriptor, for nesting it in another.
+	int fd() const;
+private:
+	enum {
+		kCtlAdd = 1,
+		kCtlDel = 2,
+		kCtlMod = 3
+	};
+
+	int fd_ = -1;
+};
+
+int Epoll::open() {
+	fd_ = syscall::epollCreate1(0);
+	return fd_ < 0 ? fd_ : 0;
+}
+
+int Epoll::fd() const {
+	return fd_;
+}
+
+int Epoll::close() {
+	int r = syscall::close(fd_);
+	fd_ = -1;
+	return r;
+}
+
+int Epoll::add(int fd, uint events, u64 data) {
+	Event e = {events, data};
+	return syscall::epollCtl(fd_, kCtlAdd, fd, &e);
+}
+
+int Epoll::mod(int fd, uint events, u64 data) {
+	Event e = {events, data};
+	return syscall::epollCtl(fd_, kCtlMod, fd, &e);
+}
+
+int Epoll::del(int fd) {
+	return syscall::epollCtl(fd_, kCtlDel, fd, nullptr);
+}
+
+int Epoll::wait(Event *events, int n, int timeout) {
+	return syscall::epollWait(fd_, events, n, timeout);
+}
+
+} // namespace io
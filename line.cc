@@ -0,0 +1,170 @@
+// Line mode
+// depends on def.h, syscall.cc, mem.cc
+// Rewrites the sent stream for line protocols: LF becomes
+// CRLF, and whole lines can be held back until their newline
+// arrives. Newlines are found 16 bytes at a time with SSE2,
+// which every x86-64 has, and runs between them are copied
+// whole.
+
+namespace line {
+
+namespace {
+typedef char V16 __attribute__((vector_size(16)));
+
+// load, store
+// Unaligned vector moves; -ffreestanding turns off the
+// memcpy builtin, so ask for it by name.
+
+inline V16 load(const u8 *p) {
+	V16 v;
+	__builtin_memcpy(&v, p, sizeof v);
+	return v;
+}
+
+inline void store(u8 *p, V16 v) {
+	__builtin_memcpy(p, &v, sizeof v);
+}
+
+// newlines
+// Returns a mask with bit i set if p[i] is a newline.
+inline uint newlines(V16 v) {
+	V16 nl = v == '\n';
+	return static_cast<uint>(__builtin_ia32_pmovmskb128(nl));
+}
+
+// lastNewline
+// Returns the offset just past the last newline
+// in p, or 0 if there is none.
+u64 lastNewline(const u8 *p, u64 n) {
+	while (n % 16 != 0) {
+		if (p[--n] == '\n') return n + 1;
+	}
+	while (n > 0) {
+		n -= 16;
+		uint mask = newlines(load(&p[n]));
+		if (mask != 0) return n + 32 - static_cast<u64>(__builtin_clz(mask));
+	}
+	return 0;
+}
+} // namespace
+
+// Filter
+// Line processing of one direction. With crlf, a newline
+// gains a carriage return unless it already has one. With
+// lines, output is cut after the last newline and the
+// partial line is carried, already translated, to the front
+// of the next output, so no byte is scanned twice.
+class Filter {
+public:
+	// init
+	// Sizes buffers for reads of up to max bytes.
+	// Returns 0 or the negated errno.
+	int init(u64 max, bool crlf, bool lines);
+
+	// run
+	// Processes n bytes of in and points out at what is
+	// ready to send, returning its length.
+	u64 run(const u8 *in, u64 n, const u8 **out);
+
+	// finish
+	// Hands over the held partial line at end of file.
+	u64 finish(const u8 **out);
+private:
+	u64 translate(const u8 *in, u64 n, u8 *out, u64 *end);
+
+	u64 max_ = 0;
+	bool crlf_ = false;
+	bool lines_ = false;
+	bool lastCr_ = false; // last byte translated was a carriage return
+	u8 *bufs_[2] = {nullptr, nullptr};
+	int cur_ = 0;         // buffer holding the partial line
+	u64 held_ = 0;
+};
+
+int Filter::init(u64 max, bool crlf, bool lines) {
+	max_ = max;
+	crlf_ = crlf;
+	lines_ = lines;
+	// A held line, then every byte of a read doubled,
+	// and room for the last vector store to spill.
+	int i;
+	for (i = 0; i < 2; i++) {
+		bufs_[i] = static_cast<u8 *>(mem::pages(3 * max + 16));
+		if (bufs_[i] == nullptr) return -syscall::kENoMem;
+	}
+	return 0;
+}
+
+// translate
+// Copies in to out adding carriage returns, returns the
+// length written and sets end past the last newline
+// written, leaving it alone if there is none.
+u64 Filter::translate(const u8 *in, u64 n, u8 *out, u64 *end) {
+	if (n == 0) return 0;
+	if (!crlf_) {
+		memcpy(out, in, n);
+		u64 e = lastNewline(in, n);
+		if (e != 0) *end = e;
+		return n;
+	}
+	u8 *o = out;
+	u64 i = 0;
+	// Runs are copied with whole vector stores that may
+	// spill past them; what follows overwrites the spill.
+	// Loads stop 16 bytes short of the end of in.
+	for (; i + 32 <= n; i += 16) {
+		V16 v = load(&in[i]);
+		uint mask = newlines(v);
+		if (mask == 0) {
+			store(o, v);
+			o += 16;
+			continue;
+		}
+		u64 from = i;
+		do {
+			u64 at = i + static_cast<u64>(__builtin_ctz(mask));
+			mask &= mask - 1;
+			store(o, load(&in[from]));
+			o += at - from;
+			bool cr = at > 0 ? in[at - 1] == '\r' : lastCr_;
+			if (!cr) *o++ = '\r';
+			*o++ = '\n';
+			*end = static_cast<u64>(o - out);
+			from = at + 1;
+		} while (mask != 0);
+		store(o, load(&in[from]));
+		o += i + 16 - from;
+	}
+	for (; i < n; i++) {
+		if (in[i] == '\n' && !(i > 0 ? in[i - 1] == '\r' : lastCr_)) *o++ = '\r';
+		*o++ = in[i];
+		if (in[i] == '\n') *end = static_cast<u64>(o - out);
+	}
+	lastCr_ = in[n - 1] == '\r';
+	return static_cast<u64>(o - out);
+}
+
+u64 Filter::run(const u8 *in, u64 n, const u8 **out) {
+	u8 *buf = bufs_[cur_];
+	u64 end = 0;
+	u64 len = held_ + translate(in, n, &buf[held_], &end);
+	*out = buf;
+	if (!lines_) return len;
+
+	u64 ready = end != 0 ? held_ + end : 0;
+	// A line longer than a read goes out in pieces.
+	if (ready == 0 && len > max_) ready = len;
+	cur_ ^= 1;
+	held_ = len - ready;
+	memcpy(bufs_[cur_], &buf[ready], held_);
+	return ready;
+}
+
+u64 Filter::finish(const u8 **out) {
+	*out = bufs_[cur_];
+	u64 n = held_;
+	held_ = 0;
+	return n;
+}
+
+} // namespace line
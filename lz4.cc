@@ -0,0 +1,622 @@
+// LZ4
+// depends on def.h, syscall.cc, mem.cc
+// Streaming compression in the LZ4 frame format, readable
+// by the lz4 tool. Blocks are linked: matches reach back
+// into the previous 64k of the stream, so small relay
+// writes still compress against what came before. Matches
+// are found through a hash table of chains over the window.
+
+namespace lz4 {
+
+enum {
+	kBlockSize = 0x10000,  // blocks written, a read of the relay
+	kMaxBlock  = 0x400000, // largest block a frame may declare
+	kWindow    = 0x10000,  // how far back matches reach
+	kMaxPush   = 0x10000   // compressed bytes taken at a time
+};
+
+namespace {
+enum : uint {
+	kMagic      = 0x184d2204,
+	kSkipMagic  = 0x184d2a50, // low nibble free
+	kUncompressed = 0x80000000 // block size flag
+};
+
+enum {
+	kMinMatch     = 4,
+	kLastLiterals = 5,  // a block ends in at least this many literals
+	kMatchLimit   = 12, // and its last match starts at least this far from the end
+	kHashLog      = 14,
+	kAttempts     = 4,  // chain links followed per position
+	kGoodMatch    = 16, // or until a match this long
+	kSkipTrigger  = 6,  // misses before stepping faster over incompressible data
+	kHistSize     = kWindow + 8 * kBlockSize,
+	kSlack        = 0x20  // past buffer ends, for wild copies
+};
+
+// Frame descriptor flags
+enum : u8 {
+	kVersion       = 0x40,
+	kBlockIndep    = 0x20,
+	kBlockChecksum = 0x10,
+	kContentSize   = 0x08,
+	kContentChecksum = 0x04,
+	kDictId        = 0x01
+};
+
+inline uint read32(const u8 *p) {
+	uint v;
+	__builtin_memcpy(&v, p, sizeof v);
+	return v;
+}
+
+inline u64 read64(const u8 *p) {
+	u64 v;
+	__builtin_memcpy(&v, p, sizeof v);
+	return v;
+}
+
+inline void write32(u8 *p, uint v) {
+	__builtin_memcpy(p, &v, sizeof v);
+}
+
+// wildCopy
+// Copies n bytes 16 at a time, so it may read and write
+// up to 15 past them; sources 16 behind may overlap.
+inline void wildCopy(u8 *d, const u8 *s, u64 n) {
+	u8 *e = d + n;
+	do {
+		u8 t[16];
+		__builtin_memcpy(t, s, sizeof t);
+		__builtin_memcpy(d, t, sizeof t);
+		d += 16;
+		s += 16;
+	} while (d < e);
+}
+
+inline uint rotl(uint v, int n) {
+	return (v << n) | (v >> (32 - n));
+}
+
+// count
+// Returns how many bytes a and b have in common,
+// stopping at limit.
+u64 count(const u8 *a, const u8 *b, const u8 *limit) {
+	const u8 *start = a;
+	while (a + 8 <= limit) {
+		u64 x = read64(a) ^ read64(b);
+		if (x != 0) return static_cast<u64>(a - start) + static_cast<u64>(__builtin_ctzll(x)) / 8;
+		a += 8;
+		b += 8;
+	}
+	while (a < limit && *a == *b) {
+		a++;
+		b++;
+	}
+	return static_cast<u64>(a - start);
+}
+
+// putLength
+// Appends the bytes continuing a length that overflowed its nibble.
+u8 *putLength(u8 *op, u64 n) {
+	while (n >= 0xff) {
+		*op++ = 0xff;
+		n -= 0xff;
+	}
+	*op++ = static_cast<u8>(n);
+	return op;
+}
+
+// getLength
+// Reads the bytes continuing a length, returns false past end.
+bool getLength(const u8 **ip, const u8 *end, u64 *n) {
+	const u8 *p = *ip;
+	u8 b;
+	do {
+		if (p == end) return false;
+		b = *p++;
+		*n += b;
+	} while (b == 0xff);
+	*ip = p;
+	return true;
+}
+
+// sequence
+// Appends literals and the match after them,
+// the last sequence of a block has no match.
+u8 *sequence(u8 *op, const u8 *lit, u64 litLen, u64 offset, u64 len) {
+	u8 *token = op++;
+	*token = static_cast<u8>((litLen < 15 ? litLen : 15) << 4);
+	if (litLen >= 15) op = putLength(op, litLen - 15);
+	wildCopy(op, lit, litLen);
+	op += litLen;
+	if (len == 0) return op;
+	*op++ = static_cast<u8>(offset);
+	*op++ = static_cast<u8>(offset >> 8);
+	len -= kMinMatch;
+	*token |= static_cast<u8>(len < 15 ? len : 15);
+	if (len >= 15) op = putLength(op, len - 15);
+	return op;
+}
+
+// decode
+// Decodes a compressed block of n bytes into dst, with
+// matches allowed back to lowest. Returns the length
+// decoded, or -1 if the block is corrupt or too large.
+// Both buffers need kSlack bytes past their ends.
+i64 decode(const u8 *src, u64 n, u8 *dst, u64 cap, const u8 *lowest) {
+	const u8 *ip = src, *iend = src + n;
+	u8 *op = dst, *oend = dst + cap;
+	for (;;) {
+		if (ip == iend) return -1;
+		u8 token = *ip++;
+		u64 lit = token >> 4;
+		if (lit == 15 && !getLength(&ip, iend, &lit)) return -1;
+		if (lit > static_cast<u64>(iend - ip) || lit > static_cast<u64>(oend - op)) return -1;
+		wildCopy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return -1;
+		u64 offset = ip[0] | static_cast<u64>(ip[1]) << 8;
+		ip += 2;
+		if (offset == 0 || offset > static_cast<u64>(op - lowest)) return -1;
+		u64 len = token & 15;
+		if (len == 15 && !getLength(&ip, iend, &len)) return -1;
+		len += kMinMatch;
+		if (len > static_cast<u64>(oend - op)) return -1;
+		// Matches may overlap what they write, so
+		// close ones copy in smaller steps.
+		const u8 *m = op - offset;
+		u8 *e = op + len;
+		if (offset >= 16) {
+			wildCopy(op, m, len);
+		} else if (offset >= 8) {
+			for (; op < e; op += 8, m += 8) {
+				u64 v = read64(m);
+				__builtin_memcpy(op, &v, sizeof v);
+			}
+		} else {
+			while (op < e) *op++ = *m++;
+		}
+		op = e;
+	}
+	return op - dst;
+}
+} // namespace
+
+// Hash32
+// xxHash32 with seed 0, the frame format's checksum.
+class Hash32 {
+public:
+	Hash32() { reset(); }
+	void reset();
+	void update(const u8 *p, u64 n);
+	uint digest() const;
+
+	static uint of(const u8 *p, u64 n);
+private:
+	enum : uint {
+		kPrime1 = 2654435761u,
+		kPrime2 = 2246822519u,
+		kPrime3 = 3266489917u,
+		kPrime4 = 668265263u,
+		kPrime5 = 374761393u
+	};
+
+	static uint round(uint acc, uint in);
+
+	uint v_[4];
+	u64 total_;
+	u8 mem_[16];
+	uint memLen_;
+};
+
+uint Hash32::round(uint acc, uint in) {
+	return rotl(acc + in * kPrime2, 13) * kPrime1;
+}
+
+void Hash32::reset() {
+	v_[0] = kPrime1 + kPrime2;
+	v_[1] = kPrime2;
+	v_[2] = 0;
+	v_[3] = 0u - kPrime1;
+	total_ = 0;
+	memLen_ = 0;
+}
+
+void Hash32::update(const u8 *p, u64 n) {
+	total_ += n;
+	if (memLen_ + n < 16) {
+		memcpy(&mem_[memLen_], p, n);
+		memLen_ += static_cast<uint>(n);
+		return;
+	}
+	if (memLen_ > 0) {
+		uint take = 16 - memLen_;
+		memcpy(&mem_[memLen_], p, take);
+		int i;
+		for (i = 0; i < 4; i++) v_[i] = round(v_[i], read32(&mem_[4 * i]));
+		p += take;
+		n -= take;
+		memLen_ = 0;
+	}
+	uint v0 = v_[0], v1 = v_[1], v2 = v_[2], v3 = v_[3];
+	for (; n >= 16; p += 16, n -= 16) {
+		v0 = round(v0, read32(p));
+		v1 = round(v1, read32(p + 4));
+		v2 = round(v2, read32(p + 8));
+		v3 = round(v3, read32(p + 12));
+	}
+	v_[0] = v0;
+	v_[1] = v1;
+	v_[2] = v2;
+	v_[3] = v3;
+	memcpy(mem_, p, n);
+	memLen_ = static_cast<uint>(n);
+}
+
+uint Hash32::digest() const {
+	uint h;
+	if (total_ >= 16) h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+	else h = kPrime5;
+	h += static_cast<uint>(total_);
+	uint i = 0;
+	for (; i + 4 <= memLen_; i += 4) h = rotl(h + read32(&mem_[i]) * kPrime3, 17) * kPrime4;
+	for (; i < memLen_; i++) h = rotl(h + mem_[i] * kPrime5, 11) * kPrime1;
+	h ^= h >> 15;
+	h *= kPrime2;
+	h ^= h >> 13;
+	h *= kPrime3;
+	h ^= h >> 16;
+	return h;
+}
+
+uint Hash32::of(const u8 *p, u64 n) {
+	Hash32 h;
+	h.update(p, n);
+	return h.digest();
+}
+
+// Encoder
+// Compresses a stream into one frame, a block per write.
+class Encoder {
+public:
+	// init
+	// Returns 0 or the negated errno.
+	int init();
+
+	// block
+	// Compresses up to kBlockSize bytes into a block, after
+	// the frame header for the first. Points out at it and
+	// returns its length.
+	u64 block(const u8 *in, u64 n, const u8 **out);
+
+	// end
+	// Points out at the end mark and content checksum,
+	// after the frame header if there were no blocks.
+	u64 end(const u8 **out);
+private:
+	u8 *header(u8 *op);
+	uint insert(u64 i);
+	u64 find(u64 i, u64 limit, u64 *offset);
+	u64 compress(u64 start, u64 n, u8 *dst);
+
+	bool started_ = false;
+	u8 *hist_ = nullptr; // the window, then the block being compressed
+	u64 end_ = 0;        // end of the data in hist_
+	u64 base_ = 0;       // stream position of hist_[0]
+	uint *head_ = nullptr;
+	u16 *chain_ = nullptr;
+	u8 *out_ = nullptr;
+	Hash32 hash_;
+};
+
+int Encoder::init() {
+	hist_ = static_cast<u8 *>(mem::pages(kHistSize + kSlack));
+	head_ = static_cast<uint *>(mem::pages(sizeof(uint) << kHashLog));
+	chain_ = static_cast<u16 *>(mem::pages(sizeof(u16) * kWindow));
+	// Header, block size and the worst case of
+	// incompressible data, which compress overruns.
+	out_ = static_cast<u8 *>(mem::pages(kBlockSize + kBlockSize / 0xff + 0x20 + kSlack));
+	if (hist_ == nullptr || head_ == nullptr || chain_ == nullptr || out_ == nullptr) return -syscall::kENoMem;
+	return 0;
+}
+
+// insert
+// Makes position i the head of its hash chain and
+// returns the distance to the previous one.
+uint Encoder::insert(u64 i) {
+	uint p = static_cast<uint>(base_ + i);
+	uint h = (read32(&hist_[i]) * 2654435761u) >> (32 - kHashLog);
+	uint offset = p - head_[h];
+	head_[h] = p;
+	chain_[p % kWindow] = static_cast<u16>(offset < kWindow ? offset : 0);
+	return offset;
+}
+
+// find
+// Walks the chain at i for the longest match ending
+// by limit. Returns its length, 0 for none. Chain
+// links may be stale, every candidate is compared.
+u64 Encoder::find(u64 i, u64 limit, u64 *offset) {
+	uint p = static_cast<uint>(base_ + i);
+	uint d = insert(i);
+	u64 best = 0;
+	uint first = read32(&hist_[i]);
+	int n;
+	for (n = 0; n < kAttempts && d != 0 && d < kWindow && d <= i; n++) {
+		const u8 *m = &hist_[i - d];
+		if (read32(m) == first) {
+			u64 len = kMinMatch + count(&hist_[i + kMinMatch], m + kMinMatch, &hist_[limit]);
+			if (len > best) {
+				best = len;
+				*offset = d;
+				if (len >= kGoodMatch) break;
+			}
+		}
+		u16 next = chain_[(p - d) % kWindow];
+		if (next == 0) break;
+		d += next;
+	}
+	return best;
+}
+
+// compress
+// Compresses hist_[start, start + n) into dst, matching
+// back into the window. Returns the compressed length.
+u64 Encoder::compress(u64 start, u64 n, u8 *dst) {
+	u8 *op = dst;
+	u64 anchor = start, i = start, end = start + n;
+	if (n > kMatchLimit) {
+		u64 limit = end - kMatchLimit;
+		uint misses = 0;
+		while (i < limit) {
+			u64 offset = 0;
+			u64 len = find(i, end - kLastLiterals, &offset);
+			if (len == 0) {
+				i += 1 + (misses++ >> kSkipTrigger);
+				continue;
+			}
+			misses = 0;
+			while (i > anchor && offset < i && hist_[i - 1] == hist_[i - 1 - offset]) {
+				i--;
+				len++;
+			}
+			op = sequence(op, &hist_[anchor], i - anchor, offset, len);
+			i += len;
+			anchor = i;
+			if (i < limit) insert(i - 2);
+		}
+	}
+	op = sequence(op, &hist_[anchor], end - anchor, 0, 0);
+	return static_cast<u64>(op - dst);
+}
+
+// header
+// Appends the frame header ahead of the first block.
+u8 *Encoder::header(u8 *op) {
+	if (started_) return op;
+	started_ = true;
+	write32(op, kMagic);
+	op[4] = kVersion | kContentChecksum;
+	op[5] = 4 << 4; // 64k blocks
+	op[6] = static_cast<u8>(Hash32::of(&op[4], 2) >> 8);
+	return op + 7;
+}
+
+u64 Encoder::block(const u8 *in, u64 n, const u8 **out) {
+	u8 *op = header(out_);
+	// Keep the last window, the regions never overlap.
+	if (end_ + n > kHistSize) {
+		memcpy(hist_, &hist_[end_ - kWindow], kWindow);
+		base_ += end_ - kWindow;
+		end_ = kWindow;
+	}
+	memcpy(&hist_[end_], in, n);
+	hash_.update(in, n);
+
+	// Data that did not shrink is stored instead.
+	u64 c = compress(end_, n, op + 4);
+	if (c < n) {
+		write32(op, static_cast<uint>(c));
+	} else {
+		c = n;
+		write32(op, static_cast<uint>(n) | kUncompressed);
+		memcpy(op + 4, in, n);
+	}
+	end_ += n;
+	*out = out_;
+	return static_cast<u64>(op + 4 + c - out_);
+}
+
+u64 Encoder::end(const u8 **out) {
+	u8 *op = header(out_);
+	write32(op, 0);
+	write32(op + 4, hash_.digest());
+	*out = out_;
+	return static_cast<u64>(op + 8 - out_);
+}
+
+// Decoder
+// Decompresses a stream of frames, as written by
+// Encoder or the lz4 tool, block by block.
+class Decoder {
+public:
+	// init
+	// Returns 0 or the negated errno.
+	int init();
+
+	// push
+	// Takes up to kMaxPush more bytes of the stream;
+	// call next until it returns 0 before pushing more.
+	void push(const u8 *in, u64 n);
+
+	// next
+	// Decodes the next whole block pushed, pointing out at
+	// it. Returns its length, 0 if more input is needed, or
+	// the negated EBADMSG if the stream is corrupt.
+	i64 next(const u8 **out);
+
+	// ended
+	// Whether the stream pushed ends with a whole frame,
+	// end mark and checksum included; anything else was
+	// cut short.
+	bool ended() const;
+private:
+	enum class State {
+		kMagic,
+		kSkip,
+		kDescriptor,
+		kSize,
+		kBlock,
+		kChecksum
+	};
+
+	enum {
+		kInSize  = kMaxBlock + kMaxPush + 0x100,
+		kOutSize = 2 * kWindow + kMaxBlock
+	};
+
+	State state_ = State::kMagic;
+	u8 *in_ = nullptr;
+	u64 pos_ = 0; // first byte not consumed
+	u64 len_ = 0; // end of the bytes pushed
+	u8 *out_ = nullptr;
+	u64 outEnd_ = 0;
+	u64 histStart_ = 0; // first byte matches may reach
+	u64 skip_ = 0;
+	u64 size_ = 0;
+	bool raw_ = false;
+	u8 flags_ = 0;
+	u64 blockMax_ = 0;
+	bool framed_ = false; // a frame has ended
+	Hash32 hash_;
+};
+
+int Decoder::init() {
+	// Mapped pages are only backed once touched, so
+	// room for the largest blocks costs nothing until used.
+	in_ = static_cast<u8 *>(mem::pages(kInSize + kSlack));
+	out_ = static_cast<u8 *>(mem::pages(kOutSize + kSlack));
+	if (in_ == nullptr || out_ == nullptr) return -syscall::kENoMem;
+	return 0;
+}
+
+void Decoder::push(const u8 *in, u64 n) {
+	if (len_ + n > kInSize) {
+		u64 i;
+		for (i = 0; i < len_ - pos_; i++) in_[i] = in_[pos_ + i];
+		len_ -= pos_;
+		pos_ = 0;
+	}
+	memcpy(&in_[len_], in, n);
+	len_ += n;
+}
+
+bool Decoder::ended() const {
+	return framed_ && state_ == State::kMagic && pos_ == len_;
+}
+
+i64 Decoder::next(const u8 **out) {
+	for (;;) {
+		const u8 *p = &in_[pos_];
+		u64 have = len_ - pos_;
+		switch (state_) {
+		case State::kMagic: {
+			if (have < 4) return 0;
+			uint magic = read32(p);
+			if ((magic & ~0xfu) == kSkipMagic) {
+				if (have < 8) return 0;
+				skip_ = read32(p + 4);
+				pos_ += 8;
+				state_ = State::kSkip;
+				break;
+			}
+			if (magic != kMagic) return -syscall::kEBadMsg;
+			pos_ += 4;
+			state_ = State::kDescriptor;
+			break;
+		}
+		case State::kSkip: {
+			if (have == 0) return 0;
+			u64 n = have < skip_ ? have : skip_;
+			pos_ += n;
+			skip_ -= n;
+			if (skip_ == 0) state_ = State::kMagic;
+			break;
+		}
+		case State::kDescriptor: {
+			if (have < 2) return 0;
+			u8 flg = p[0], bd = p[1];
+			u64 len = 3u + (flg & kContentSize ? 8u : 0u) + (flg & kDictId ? 4u : 0u);
+			if (have < len) return 0;
+			// Dictionaries are agreed out of band, there is none.
+			if ((flg & 0xc2) != kVersion || (flg & kDictId) || (bd & 0x8f) != 0 || (bd >> 4) < 4) return -syscall::kEBadMsg;
+			if (p[len - 1] != static_cast<u8>(Hash32::of(p, len - 1) >> 8)) return -syscall::kEBadMsg;
+			flags_ = flg;
+			blockMax_ = 1ull << (8 + 2 * (bd >> 4));
+			hash_.reset();
+			outEnd_ = histStart_ = 0;
+			pos_ += len;
+			state_ = State::kSize;
+			break;
+		}
+		case State::kSize: {
+			if (have < 4) return 0;
+			uint size = read32(p);
+			pos_ += 4;
+			if (size == 0) {
+				state_ = State::kChecksum;
+				break;
+			}
+			raw_ = size & kUncompressed;
+			size_ = size & ~kUncompressed;
+			if (size_ > blockMax_) return -syscall::kEBadMsg;
+			state_ = State::kBlock;
+			break;
+		}
+		case State::kBlock: {
+			u64 sum = flags_ & kBlockChecksum ? 4 : 0;
+			if (have < size_ + sum) return 0;
+			if (sum != 0 && read32(p + size_) != Hash32::of(p, size_)) return -syscall::kEBadMsg;
+			// Keep the last window ahead of the block.
+			if (outEnd_ + blockMax_ > kOutSize) {
+				u64 from = outEnd_ - kWindow;
+				memcpy(out_, &out_[from], kWindow);
+				histStart_ = histStart_ > from ? histStart_ - from : 0;
+				outEnd_ = kWindow;
+			}
+			if (flags_ & kBlockIndep) histStart_ = outEnd_;
+			i64 n;
+			if (raw_) {
+				memcpy(&out_[outEnd_], p, size_);
+				n = static_cast<i64>(size_);
+			} else {
+				n = decode(p, size_, &out_[outEnd_], blockMax_, &out_[histStart_]);
+				if (n < 0) return -syscall::kEBadMsg;
+			}
+			pos_ += size_ + sum;
+			state_ = State::kSize;
+			hash_.update(&out_[outEnd_], static_cast<u64>(n));
+			*out = &out_[outEnd_];
+			outEnd_ += static_cast<u64>(n);
+			if (n > 0) return n;
+			break;
+		}
+		case State::kChecksum: {
+			if (flags_ & kContentChecksum) {
+				if (have < 4) return 0;
+				if (read32(p) != hash_.digest()) return -syscall::kEBadMsg;
+				pos_ += 4;
+			}
+			framed_ = true;
+			state_ = State::kMagic;
+			break;
+		}
+		}
+	}
+}
+
+} // namespace lz4
@@ -7,12 +7,16 @@ fi
 
 BIN="nc"
 SRC="nc.cc"
-FLAGS="-nostdlib -fno-rtti -fno-exceptions -g -std=c++11 -Weverything \
+FLAGS="-nostdlib -static -fno-stack-protector -fno-rtti -fno-exceptions -ffreestanding -O2 -g -std=c++11 -Weverything \
 -Wno-c++98-compat -Wno-c++98-compat-pedantic -Wno-padded -Wno-weak-vtables \
 -Wno-missing-prototypes -Wno-global-constructors -Wno-exit-time-destructors \
 -Wno-missing-variable-declarations"
 # Since I include all .cc files, weak vtables will exits.
 # But there is only one translation unit, so who cares.
 # Also, there will be no function prototypes because we include .cc files.
+# Without a dynamic loader nothing applies relocations, so link statically;
+# without TLS set up there is no stack protector canary to read.
+# Freestanding keeps the optimizer from turning loops into calls
+# to libc string functions we do not define.
 
 ${CXX} ${FLAGS} ${SRC} -o ${BIN}
@@ -1,5 +1,5 @@
 // Memory utility methods.
-// depends on def.h
+// depends on def.h, syscall.cc, sync.cc, tls.cc
 
 // Mem utility functions
 namespace mem {
@@ -76,11 +76,23 @@ public:
 
 void *MMap::map(void *addr, u64 len, u64 prot, u64 flags,
 	int fd, u64 offset) {
-	return reinterpret_cast<void *>(syscall::call(syscall::Call::kMMap, reinterpret_cast<u64>(addr), len, prot, flags, static_cast<u64>(fd), offset));
+	return reinterpret_cast<void *>(syscall::mmap(addr, len, static_cast<int>(prot), static_cast<int>(flags), fd, offset));
 }
 
 int MMap::unmap(void *addr, u64 len) {
-	return static_cast<int>(syscall::call(syscall::Call::kMUnmap, reinterpret_cast<u64>(addr), len, 0, 0, 0, 0));
+	return syscall::munmap(addr, len);
+}
+
+// pages
+// Maps size bytes of zeroed private memory,
+// for buffers that outlive malloc's chunk sizes.
+// Returns nullptr on failure.
+void *pages(u64 size) {
+	void *mem = MMap::map(nullptr, align(size, pageSize),
+		static_cast<int>(MMap::Prot::kRead) | static_cast<int>(MMap::Prot::kWrite),
+		static_cast<int>(MMap::Flag::kPrivate) | static_cast<int>(MMap::Flag::kAnon),
+		-1, 0);
+	return syscall::err(reinterpret_cast<i64>(mem)) ? nullptr : mem;
 }
 
 // Chunk
@@ -105,9 +117,6 @@ public:
 	// n: index in the list wanted.
 	Chunk *traverse(int n);
 
-	// Swap linked list location with other.
-	void swap(Chunk *other);
-
 	// Split chunk if enough room.
 	Chunk *split(size_t sz);
 
@@ -134,6 +143,7 @@ public:
 	size_t size_ = 0; // total size, including header.
 	Chunk *next = nullptr;
 	Chunk *prev = nullptr;
+	bool cached = false; // a block of a per-thread cache
 private:
 	// Size of chunk as header.
 	static size_t header();
@@ -152,30 +162,15 @@ Chunk *Chunk::traverse(int n) {
 	return chunk;
 }
 
-void Chunk::swap(Chunk *other) {
-	if (this == other) return;
-	Chunk *n = next;
-	Chunk *p = prev;
-	next = other->next;
-	prev = other->prev;
-	if (prev != nullptr) prev->next = this;
-	if (next != nullptr) next->prev = this;
-	other->next = n;
-	other->prev = p;
-	if (other->prev != nullptr) other->prev->next = other;
-	if (other->next != nullptr) other->next->prev = other;
-}
-
 // Allocates n pages as a chunk
 Chunk *Chunk::map(int pages) {
 	void *mem = MMap::map(nullptr, static_cast<u64>(pages * pageSize),
 		static_cast<int>(MMap::Prot::kRead) | static_cast<int>(MMap::Prot::kWrite),
 		static_cast<int>(MMap::Flag::kPrivate) | static_cast<int>(MMap::Flag::kAnon),
 		-1, 0);
-	mem = syscall::err(reinterpret_cast<i64>(mem)) ? nullptr : mem;
-	if (mem == nullptr) return nullptr;
+	if (syscall::err(reinterpret_cast<i64>(mem))) return nullptr;
 	Chunk *m = static_cast<Chunk *>(mem);
-	*m = Chunk(static_cast<u64>(pages * pageSize));
+	*m = Chunk(static_cast<size_t>(pages * pageSize));
 	return m;
 }
 
@@ -186,13 +181,13 @@ size_t Chunk::header() {
 // Chunk::fromUserAddr
 // gets chunk from returned user address.
 Chunk *Chunk::atAddr(void *mem) {
-	return reinterpret_cast<Chunk *>(reinterpret_cast<u8*>(mem)[-Chunk::header()]);
+	return reinterpret_cast<Chunk *>(static_cast<u8*>(mem) - Chunk::header());
 }
 
 // Chunk::userAddr
 // gets user memory address from chunk.
 void *Chunk::addr() {
-	return reinterpret_cast<void*>(reinterpret_cast<u8*>(this)[Chunk::header()]);
+	return reinterpret_cast<u8*>(this) + Chunk::header();
 }
 
 // splitChunk
@@ -252,8 +247,35 @@ ChunkHeap freeChunks;
 ChunkHeap allocChunks;
 } // namespace
 
+// swap
+// Exchanges the places of two nodes in the list,
+// which may be neighbours or at either end.
 void ChunkHeap::swap(int i, int j) {
-	chunks->traverse(i)->swap(chunks->traverse(j));
+	if (i == j) return;
+	if (i > j) {
+		int t = i;
+		i = j;
+		j = t;
+	}
+	Chunk *a = chunks->traverse(i);
+	Chunk *b = a->traverse(j - i);
+	Chunk *before = a->prev, *after = b->next;
+	if (a->next == b) {
+		b->next = a;
+		a->prev = b;
+	} else {
+		Chunk *an = a->next, *bp = b->prev;
+		b->next = an;
+		an->prev = b;
+		bp->next = a;
+		a->prev = bp;
+	}
+	b->prev = before;
+	a->next = after;
+	if (before != nullptr) before->next = b;
+	else chunks = b;
+	if (after != nullptr) after->prev = a;
+	else end = a;
 }
 
 int ChunkHeap::len() {
@@ -281,7 +303,8 @@ void ChunkHeap::push(Chunk *x) {
 Chunk *ChunkHeap::pop() {
 	Chunk *x = end;
 	end = end->prev;
-	end->next = nullptr;
+	if (end != nullptr) end->next = nullptr;
+	else chunks = nullptr;
 	_len--;
 	// Unlink after pop
 	x->next = nullptr;
@@ -305,44 +328,47 @@ bool ChunkAddrHeap::less(int i, int j) {
 }
 
 // Chunk::contignify
-// finds free chunk contiguous (upwards) to chunk,
-// combines them into one chunk which is returned.
-// Continues recursively until chunk->size > size.
+// finds free chunks contiguous (upwards) to chunk and
+// takes them out of h until chunk->size >= size.
+// If there are not enough, the taken chunks, which
+// still carry their headers, go back to h.
 // TODO: Use ChunkAddrHeap to organize by address,
 // then loop through once instead of n times.
 void Chunk::contignify(Heap<Chunk *> *h, size_t sz) {
 	ChunkHeap chunks;
 	Heap<Chunk *> lh(&chunks);
 
-	Chunk *m = nullptr;
-	while (h->heap->len() > 0) {
-		m = h->pop();
-		// Checks if this chunk is contiguous
-		if (reinterpret_cast<Chunk*>(&(reinterpret_cast<u64*>(this)[size_ / sizeof(u64)])) == m) {
-			break; // found chunk
-		} else lh.push(m);
-	}
-
-	// Push local heap back to h
-	while (chunks.len() > 0) {
-		h->push(lh.pop());
+	u8 *start = reinterpret_cast<u8 *>(this);
+	size_t size = size_;
+	bool found = true;
+	while (size < sz && found) {
+		found = false;
+		while (h->heap->len() > 0) {
+			Chunk *m = h->pop();
+			// Checks if this chunk is contiguous
+			if (reinterpret_cast<u8 *>(m) == &start[size]) {
+				size += m->size_;
+				found = true;
+				break;
+			}
+			lh.push(m);
+		}
+		// Push local heap back to h
+		while (chunks.len() > 0) {
+			h->push(lh.pop());
+		}
 	}
 
-	if (m != nullptr) {
-		size_t oldsize = size_;
-		size_ += m->size_;
-		if (size_ < sz) {
-			// try to find another chunk.
-			contignify(h, sz);
-			if (size_ < sz) {
-				// reset old size.
-				size_ = oldsize;
-				return;
-			}
+	if (size < sz) {
+		size_t at;
+		for (at = size_; at < size; at += reinterpret_cast<Chunk *>(&start[at])->size_) {
+			h->push(reinterpret_cast<Chunk *>(&start[at]));
 		}
-		// found enough memory
-		::mem::zero(m, m->size_); // zero contiguous chunk
+		return;
 	}
+	// found enough memory
+	::mem::zero(&start[size_], size - size_); // zero contiguous chunks
+	size_ = size;
 }
 
 size_t Chunk::neededSize(size_t sz) {
@@ -377,7 +403,7 @@ void contignify(Heap<Chunk *> *h) {
 		}
 		last = m;
 	}
-	h->push(last);
+	if (last != nullptr) h->push(last);
 }
 
 // findChunk
@@ -426,11 +452,12 @@ Chunk *allocChunk(Heap<Chunk *> *h, size_t size) {
 		int pages = static_cast<int>(size / pageSize);
 		if (size % pageSize > 0) pages++;
 		m = Chunk::map(pages);
+		if (m == nullptr) return nullptr;
 
 		// Split off extra memory and push it
 		// back onto the heap.
 		Chunk *split = m->split(size);
-		h->push(split);
+		if (split != nullptr) h->push(split);
 	}
 	return m;
 }
@@ -475,12 +502,148 @@ void Chunk::free(Heap<Chunk *> *fh, Heap<Chunk *> *ah) {
 	::mem::contignify(fh);
 }
 
+// Per-thread caches
+// Once threads are on, small requests are served from
+// per-thread free lists of fixed size blocks, so threads
+// allocate without taking the heap lock. A list grown
+// past kCacheMax spills half into a shared depot, which
+// refills lists that run dry; slabs of fresh blocks go
+// to the depot first.
+namespace {
+enum {
+	kClasses   = 8, // block sizes 16 to 2048
+	kMinShift  = 4,
+	kMaxCached = 1 << (kMinShift + kClasses - 1),
+	kCacheMax  = 64,
+	kSlabSize  = 0x10000
+};
+
+// Cache
+// One thread's free blocks by size class.
+struct Cache {
+	Chunk *lists[kClasses];
+	uint counts[kClasses];
+};
+
+// The heaps and the depot are shared by all threads.
+sync::Mutex heapLock;
+bool threaded = false;
+Chunk *depot[kClasses];
+
+// classOf
+// Returns the class of the smallest block holding size.
+uint classOf(size_t size) {
+	if (size <= (1 << kMinShift)) return 0;
+	return static_cast<uint>(64 - __builtin_clzll(size - 1)) - kMinShift;
+}
+
+// carve
+// Cuts a slab into blocks of class k for the depot.
+// Called with the heap lock held.
+bool carve(uint k) {
+	u8 *slab = static_cast<u8 *>(pages(kSlabSize));
+	if (slab == nullptr) return false;
+	size_t size = Chunk::neededSize(static_cast<size_t>(1) << (k + kMinShift));
+	size_t at;
+	for (at = 0; at + size <= kSlabSize; at += size) {
+		Chunk *c = reinterpret_cast<Chunk *>(&slab[at]);
+		*c = Chunk(size);
+		c->cached = true;
+		c->next = depot[k];
+		depot[k] = c;
+	}
+	return true;
+}
+
+// cache
+// Returns the calling thread's cache,
+// mapping it on first use.
+Cache *cache() {
+	tls::Block *b = tls::self();
+	if (b->cache == nullptr) b->cache = pages(sizeof(Cache));
+	return static_cast<Cache *>(b->cache);
+}
+
+// move
+// Moves up to n blocks from list *from to list *to.
+uint move(Chunk **from, Chunk **to, uint n) {
+	uint i;
+	for (i = 0; i < n && *from != nullptr; i++) {
+		Chunk *c = *from;
+		*from = c->next;
+		c->next = *to;
+		*to = c;
+	}
+	return i;
+}
+
+void *cachedMalloc(size_t size) {
+	uint k = classOf(size);
+	Cache *c = cache();
+	if (c == nullptr) return nullptr;
+	if (c->lists[k] == nullptr) {
+		sync::Lock l(&heapLock);
+		if (depot[k] == nullptr && !carve(k)) return nullptr;
+		c->counts[k] += move(&depot[k], &c->lists[k], kCacheMax / 2);
+	}
+	Chunk *chunk = c->lists[k];
+	c->lists[k] = chunk->next;
+	c->counts[k]--;
+	chunk->next = nullptr;
+	chunk->zero();
+	return chunk->addr();
+}
+
+void cachedFree(Chunk *chunk) {
+	uint k = classOf(chunk->size());
+	Cache *c = cache();
+	if (c == nullptr) {
+		sync::Lock l(&heapLock);
+		chunk->next = depot[k];
+		depot[k] = chunk;
+		return;
+	}
+	chunk->next = c->lists[k];
+	c->lists[k] = chunk;
+	if (++c->counts[k] > kCacheMax) {
+		sync::Lock l(&heapLock);
+		c->counts[k] -= move(&c->lists[k], &depot[k], kCacheMax / 2);
+	}
+}
+} // namespace
+
+// threads
+// Turns on the thread-safe mode; called once the
+// calling thread has a tls block.
+void threads() {
+	threaded = true;
+}
+
+// release
+// Returns an exiting thread's cached blocks to the depot.
+void release() {
+	tls::Block *b = tls::self();
+	Cache *c = static_cast<Cache *>(b->cache);
+	if (c == nullptr) return;
+	{
+		sync::Lock l(&heapLock);
+		uint k;
+		for (k = 0; k < kClasses; k++) move(&c->lists[k], &depot[k], c->counts[k]);
+	}
+	MMap::unmap(c, align(sizeof(Cache), pageSize));
+	b->cache = nullptr;
+}
+
 // malloc, realloc and free
 // memory allocation and freeing methods.
 // all memory returned from malloc is zeroed.
+// The heaps are locked, which costs an uncontended
+// atomic until there are threads.
 // For more information, see respective man pages.
 
 void *malloc(size_t size) {
+	if (threaded && size > 0 && size <= kMaxCached) return cachedMalloc(size);
+	sync::Lock l(&heapLock);
 	Heap<Chunk *> fh(&freeChunks);
 	Heap<Chunk *> ah(&allocChunks);
 	Chunk *chunk = Chunk::malloc(&fh, &ah, size);
@@ -488,35 +651,37 @@ void *malloc(size_t size) {
 	return chunk->addr();
 }
 
-void *realloc(void *mem, size_t size) {
+void free(void *mem) {
+	if (mem == nullptr) return;
+	Chunk *chunk = Chunk::atAddr(mem);
+	if (chunk->cached) {
+		cachedFree(chunk);
+		return;
+	}
+	sync::Lock l(&heapLock);
 	Heap<Chunk *> fh(&freeChunks);
 	Heap<Chunk *> ah(&allocChunks);
+	chunk->free(&fh, &ah);
+}
 
+void *realloc(void *mem, size_t size) {
+	if (mem == nullptr) return malloc(size);
 	Chunk *chunk = Chunk::atAddr(mem);
-
-	size = Chunk::neededSize(size);
 	// Check if this chunk is large enough.
-	if (chunk->size_ >= size) {
-		return chunk->addr(); // memory is large enough.
-	} else {
-		chunk->contignify(&fh, size);
-		if (chunk->size_ >= size) {
-			return chunk->addr();
-		}
-
-		// Plan B: malloc, memcpy, free
-		Chunk *nc = Chunk::malloc(&fh, &ah, size);
-		memcpy(chunk->addr(), nc->addr(), nc->size());
-		chunk->free(&fh, &ah);
-		return nc->addr();
+	if (chunk->size() >= size) return mem;
+	if (!chunk->cached) {
+		sync::Lock l(&heapLock);
+		Heap<Chunk *> fh(&freeChunks);
+		chunk->contignify(&fh, Chunk::neededSize(size));
+		if (chunk->size() >= size) return mem;
 	}
-}
 
-void free(void *mem) {
-	if (mem == nullptr) return;
-	Heap<Chunk *> fh(&freeChunks);
-	Heap<Chunk *> ah(&allocChunks);
-	Chunk::atAddr(mem)->free(&fh, &ah);
+	// Plan B: malloc, memcpy, free
+	void *m = malloc(size);
+	if (m == nullptr) return nullptr;
+	memcpy(m, mem, chunk->size());
+	free(mem);
+	return m;
 }
 
 } // namespace mem
@@ -1,12 +1,31 @@
-
 #include "def.h"
 #include "heap.cc"
 // Syscall, Mem, String depend on def.h
 #include "syscall.cc"
 #include "symb.cc"
+#include "sync.cc"
+#include "tls.cc"
 // String, Mem depend on syscall.c
 #include "mem.cc"
+#include "thread.cc"
 // String mem.c
+#include "string.cc"
+#include "time.cc"
+#include "net.cc"
+#include "flag.cc"
+#include "io.cc"
+#include "resolve.cc"
+#include "zcopy.cc"
+#include "dump.cc"
+#include "line.cc"
+#include "lz4.cc"
+#include "crc.cc"
+#include "pace.cc"
+#include "disk.cc"
+#include "relay.cc"
+#include "broker.cc"
+#include "bench.cc"
+#include "scan.cc"
 
 /* Netcat utility
  * written with no standard library,
@@ -15,23 +34,372 @@
  */
 
 // start symbol
-extern "C" void _start(void);
+// The kernel enters _start with argc, argv and envp
+// on the stack rather than in registers, so pass the
+// stack pointer on to start with the stack aligned.
+__asm__(
+	".text\n"
+	".global _start\n"
+	"_start:\n"
+	"xorq %rbp, %rbp\n"
+	"movq %rsp, %rdi\n"
+	"andq $-16, %rsp\n"
+	"call start\n"
+	"hlt\n");
+
+extern "C" void start(u64 *sp) __attribute__((used));
 extern "C" void init(void);
 extern "C" void fini(void);
 
-extern "C" void _start() {
-	init();
-	int *arr[10];
+namespace {
+
+enum {
+	kSigPipe     = 13,
+	kSigIgnore   = 1,
+	kBacklog     = 0x80,
+	kPingSize    = 0x40,
+	kDefaultSize = 0x20000
+};
+
+const char synopsis[] = "usage: nc [flags] host port\n       nc -l [flags] [host] port\n       nc -U [-l] [flags] path\n       nc -z [flags] host[/prefix]... ports";
+
+// Options
+// Values of the command line flags.
+class Options {
+public:
+	bool listen = false;
+	bool local = false;
+	bool datagram = false;
+	bool zerocopy = false;
+	bool verbose = false;
+	bool zeroIo = false;
+	bool hexDump = false;
+	bool crlf = false;
+	bool lines = false;
+	bool lz4 = false;
+	bool checksum = false;
+	bool threads = false;
+	bool broker = false;
+	bool help = false;
+	const char *bench = nullptr;
+	const char *dumpFile = nullptr;
+	const char *outFile = nullptr;
+	const char *dns = nullptr;
+	u64 parallel = 1;
+	u64 seconds = 0;
+	u64 bytes = 0;
+	u64 size = 0;
+	u64 rate = 0;
+	u64 burst = 0;
+	u64 queue = 0;
+	net::Tuning tuning;
+	scan::Config probes;
+};
+
+// sigaction, as the kernel takes it
+struct SigAction {
+	u64 handler;
+	u64 flags;
+	u64 restorer;
+	u64 mask;
+};
+
+// ignorePipe
+// Writes to a closed socket return EPIPE
+// instead of killing nc.
+void ignorePipe() {
+	SigAction act = {kSigIgnore, 0, 0, 0};
+	syscall::rtSigAction(kSigPipe, &act, nullptr, sizeof act.mask);
+}
+
+// fail
+// Reports what failed and its errno on stderr,
+// returns the exit status.
+int fail(const char *what, i64 err) {
+	char buf[0x100];
+	string str = newString(buf, sizeof buf);
+	str = formatString(str, "nc: ", what);
+	if (syscall::err(err)) str = formatString(str, ": errno ", dec(static_cast<u64>(syscall::err(err))));
+	str = formatString(str, '\n');
+	writeString(str, kStringFdErr);
+	return 1;
+}
+
+// tune
+// Applies the socket option flags to s.
+int tune(net::Socket s, const Options &o) {
+	return o.tuning.apply(s, !o.local && !o.datagram);
+}
+
+// setup
+// tune for resolve::connect, which runs it on each
+// socket it tries.
+int setup(net::Socket s, void *o) {
+	return tune(s, *static_cast<const Options *>(o));
+}
+
+// describe
+// Reports the buffer sizes the kernel settled on,
+// which it doubles and clamps from what was asked.
+void describe(net::Socket s) {
+	int snd = 0, rcv = 0;
+	s.getOpt(net::Level::kSocket, net::Opt::kSndBuf, &snd);
+	s.getOpt(net::Level::kSocket, net::Opt::kRcvBuf, &rcv);
+	char buf[0x80];
+	string str = newString(buf, sizeof buf);
+	str = formatString(str, "nc: sndbuf ", dec(static_cast<u64>(snd)), " rcvbuf ", dec(static_cast<u64>(rcv)), '\n');
+	writeString(str, kStringFdErr);
+}
+
+// listenDatagram
+// Datagram sockets have no accept, so wait for the
+// first datagram, connect back to its sender and pass
+// it on; the relay takes it from there.
+int listenDatagram(net::Socket s, const relay::Config &rc) {
+	u8 buf[relay::kBufSize];
+	net::Addr from;
+	i64 n = s.recvFrom(buf, sizeof buf, &from);
+	if (n < 0) return static_cast<int>(n);
+	int err = s.connect(from);
+	if (err < 0) return err;
+	if (rc.log != nullptr && (err = rc.log->write(dump::Dir::kReceived, buf, static_cast<u64>(n))) < 0) return err;
+	if (rc.disk != nullptr) return rc.disk->write(buf, static_cast<u64>(n));
+	return io::writeAll(kStringFdOut, buf, static_cast<u64>(n));
+}
+
+int run(int argc, char **argv) {
+	Options o;
+	flag::Bool(&o.listen, 'l', "listen", "listen for incoming connections");
+	flag::Bool(&o.local, 'U', "unix", "use unix domain sockets, @name is abstract");
+	flag::Bool(&o.datagram, 'u', "udp", "use datagram sockets");
+	flag::Num(&o.tuning.sndbuf, '\0', "sndbuf", "socket send buffer size");
+	flag::Num(&o.tuning.rcvbuf, '\0', "rcvbuf", "socket receive buffer size");
+	flag::Bool(&o.tuning.nodelay, 'D', "nodelay", "set TCP_NODELAY, for request/response traffic");
+	flag::Bool(&o.tuning.cork, '\0', "cork", "set TCP_CORK, uncorking when input idles");
+	flag::Bool(&o.tuning.quickack, '\0', "quickack", "keep TCP_QUICKACK set");
+	flag::Num(&o.tuning.busyPoll, '\0', "busy-poll", "SO_BUSY_POLL microseconds");
+	flag::Num(&o.tuning.notSentLowAt, '\0', "notsent-lowat", "TCP_NOTSENT_LOWAT bytes");
+	flag::Num(&o.tuning.incomingCpu, '\0', "incoming-cpu", "SO_INCOMING_CPU");
+	flag::Num(&o.rate, '\0', "rate", "cap the send rate, bytes per second");
+	flag::Num(&o.burst, '\0', "burst", "most bytes sent at once under --rate, unix and UDP only");
+	flag::Bool(&o.zerocopy, '\0', "zerocopy", "send large writes with MSG_ZEROCOPY");
+	flag::String(&o.bench, 'B', "bench", "benchmark mode: source, sink, ping or echo");
+	flag::Num(&o.parallel, 'P', "parallel", "benchmark streams to open or accept");
+	flag::Num(&o.seconds, 't', "time", "benchmark duration in seconds");
+	flag::Num(&o.bytes, 'n', "bytes", "benchmark bytes per stream");
+	flag::Num(&o.size, 's', "size", "benchmark write or message size");
+	flag::Bool(&o.zeroIo, 'z', "scan", "scan ports without sending data, ports as 1-1024,8080");
+	flag::Num(&o.probes.concurrency, '\0', "concurrency", "scan probes in flight");
+	flag::Num(&o.probes.timeout, '\0', "probe-timeout", "scan probe timeout in milliseconds");
+	flag::String(&o.dns, '\0', "dns", "nameserver to ask instead of resolv.conf's, address[:port]");
+	flag::Bool(&o.crlf, 'C', "crlf", "send newlines as CRLF");
+	flag::Bool(&o.lines, '\0', "line", "send input a whole line at a time");
+	flag::Bool(&o.lz4, '\0', "lz4", "compress the stream as LZ4 frames, both ends need it");
+	flag::Bool(&o.checksum, '\0', "checksum", "report the CRC32C of the data sent and received");
+	flag::Bool(&o.threads, '\0', "threads", "relay each direction on its own thread");
+	flag::Bool(&o.broker, '\0', "broker", "with -l, send what stdin or any client sends to all other clients");
+	flag::Num(&o.queue, '\0', "queue", "broker bytes a client may fall behind before holding senders back");
+	flag::String(&o.outFile, 'O', "out-file", "write received data to a file, bypassing the page cache");
+	flag::String(&o.dumpFile, 'o', "output", "log relayed traffic as hex to a file");
+	flag::Bool(&o.hexDump, 'x', "hex-dump", "log relayed traffic as hex to stderr");
+	flag::Bool(&o.verbose, 'v', "verbose", "report socket buffer sizes, closed ports when scanning");
+	flag::Bool(&o.help, 'h', "help", "print this message");
 
-	int i;
-	for (i = 0; i < 10; i++) {
-		arr[i] = new int[0x1000];
+	int i = flag::parse(argc, argv);
+	if (i < 0 || o.help) {
+		flag::usage(synopsis);
+		return i < 0 ? 2 : 0;
 	}
+	o.tuning.maxPacingRate = o.rate;
+	if (!o.tuning.valid()) return fail("socket option too large", 0);
 
-	for (i = 0; i < 10; i++) {
-		delete arr[i];
+	resolve::Config dc;
+	if (o.dns != nullptr && !resolve::parseServer(o.dns, &dc.server)) return fail("bad nameserver", 0);
+	resolve::init(dc);
+
+	if (o.zeroIo) {
+		if (argc - i < 2) {
+			flag::usage(synopsis);
+			return 2;
+		}
+		scan::Targets t;
+		if (!t.init(&argv[i], argc - i - 1, argv[argc - 1])) return fail("bad scan targets", 0);
+		o.probes.verbose = o.verbose;
+		i64 open = scan::run(o.probes, &t);
+		if (open < 0) return fail("scan", open);
+		return open > 0 ? 0 : 1;
+	}
+
+	net::Addr addr;
+	resolve::Result found;
+	u16 port = 0;
+	if (o.local) {
+		if (argc - i != 1) {
+			flag::usage(synopsis);
+			return 2;
+		}
+		if (!net::Addr::local(&addr, argv[i])) return fail("bad path", 0);
+	} else {
+		const char *host = nullptr, *portArg = nullptr;
+		if (argc - i == 2) {
+			host = argv[i];
+			portArg = argv[i + 1];
+		} else if (argc - i == 1 && o.listen) {
+			portArg = argv[i];
+		} else {
+			flag::usage(synopsis);
+			return 2;
+		}
+		if (!net::parsePort(portArg, &port)) return fail("bad port", 0);
+		addr = net::Addr::inet(0, port);
+		if (host != nullptr) {
+			int err = resolve::lookup(host, &found);
+			if (syscall::err(err) == syscall::kENoEnt) return fail("unknown host", 0);
+			if (err < 0) return fail("resolve", err);
+			addr = found.ip[0].addr(port);
+		}
+	}
+	int type = static_cast<int>(o.datagram ? net::Type::kDgram : net::Type::kStream);
+
+	bench::Config bc;
+	if (o.bench != nullptr) {
+		bc.mode = bench::mode(o.bench);
+		if (bc.mode == bench::Mode::kNone) return fail("unknown benchmark mode", 0);
+	}
+	bc.streams = o.parallel;
+	if (bc.streams == 0 || bc.streams > bench::kMaxStreams) return fail("bad stream count", 0);
+	bc.seconds = o.seconds;
+	bc.bytes = o.bytes;
+	bc.size = o.size;
+	bc.zerocopy = o.zerocopy;
+	if (bc.size == 0) bc.size = bc.mode == bench::Mode::kPing ? kPingSize : kDefaultSize;
+	if (bc.size > bench::kMaxSize) bc.size = bench::kMaxSize;
+	if (o.bench != nullptr && o.datagram) return fail("benchmarks need stream sockets", 0);
+	if (o.lz4 && o.datagram) return fail("lz4 needs stream sockets", 0);
+	if (o.broker && (o.datagram || !o.listen)) return fail("broker needs -l and stream sockets", 0);
+	if (o.burst != 0 && (o.rate == 0 || (!o.local && !o.datagram))) return fail("burst needs --rate on unix or UDP sockets", 0);
+	if ((o.local || o.datagram) && o.rate > pace::kMaxRate) return fail("rate too high to pace", 0);
+
+	// The log is opened before listening, so
+	// a bad path fails before any peer connects.
+	dump::Log log;
+	relay::Config rc;
+	if (o.dumpFile != nullptr || o.hexDump) {
+		int fd = kStringFdErr;
+		if (o.dumpFile != nullptr) {
+			fd = io::open(o.dumpFile, io::kWriteOnly | io::kCreate | io::kTruncate | io::kCloseExec, 0644);
+			if (fd < 0) return fail("open", fd);
+		}
+		int err = log.open(fd);
+		if (err < 0) return fail("hex dump", err);
+		rc.log = &log;
+	}
+
+	disk::Writer out;
+	if (o.outFile != nullptr) {
+		int err = out.open(o.outFile);
+		if (err < 0) return fail("open", err);
+		rc.disk = &out;
+	}
+
+	line::Filter filter;
+	if (o.crlf || o.lines) {
+		int err = filter.init(relay::kBufSize, o.crlf, o.lines);
+		if (err < 0) return fail("line mode", err);
+		rc.filter = &filter;
+	}
+
+	int n = o.bench != nullptr ? static_cast<int>(bc.streams) : 1;
+	net::Socket socks[bench::kMaxStreams];
+	if (o.listen) {
+		net::Socket l = net::Socket::open(addr.family(), type);
+		if (!l.ok()) return fail("socket", l.fd());
+		int err = tune(l, o);
+		if (err < 0) return fail("setsockopt", err);
+		err = l.bind(addr);
+		if (err < 0) return fail("bind", err);
+		if (o.broker) {
+			broker::Config bk;
+			bk.verbose = o.verbose;
+			if (o.queue != 0) bk.queue = o.queue;
+			err = l.listen(broker::kMaxClients);
+			if (err == 0) err = broker::run(bk, l, kStringFdIn);
+			if (addr.path() != nullptr) syscall::unlink(addr.path());
+			if (err < 0) return fail("broker", err);
+			return 0;
+		}
+		if (o.datagram) {
+			err = listenDatagram(l, rc);
+			socks[0] = l;
+		} else {
+			err = l.listen(kBacklog);
+			for (i = 0; i < n && err == 0; i++) {
+				socks[i] = l.accept(0);
+				if (!socks[i].ok()) err = socks[i].fd();
+			}
+			l.close();
+		}
+		// The name is only needed until the peers are in.
+		if (addr.path() != nullptr) {
+			syscall::unlink(addr.path());
+		}
+		if (err < 0) return fail(o.datagram ? "recvfrom" : "accept", err);
+	} else {
+		for (i = 0; i < n; i++) {
+			// Streams to a name try each of its addresses.
+			if (!o.local && !o.datagram) {
+				socks[i] = resolve::connect(found, port, setup, &o);
+				if (!socks[i].ok()) return fail("connect", socks[i].fd());
+				continue;
+			}
+			socks[i] = net::Socket::open(addr.family(), type);
+			if (!socks[i].ok()) return fail("socket", socks[i].fd());
+			int err = tune(socks[i], o);
+			if (err < 0) return fail("setsockopt", err);
+			// An unbound unix datagram socket cannot be replied to.
+			if (o.datagram && o.local) {
+				err = socks[i].bind(net::Addr::unnamed());
+				if (err < 0) return fail("bind", err);
+			}
+			err = socks[i].connect(addr);
+			if (err < 0) return fail("connect", err);
+		}
+	}
+
+	if (o.verbose) describe(socks[0]);
+
+	if (o.bench != nullptr) {
+		int err = bench::run(bc, socks, n);
+		if (err < 0) return fail("benchmark", err);
+		return 0;
+	}
+	rc.zerocopy = o.zerocopy;
+	rc.lz4 = o.lz4;
+	rc.checksum = o.checksum;
+	rc.threads = o.threads;
+	// TCP is paced by the kernel, see net::Tuning.
+	if (o.local || o.datagram) {
+		rc.rate = o.rate;
+		rc.burst = o.burst;
 	}
+	rc.cork = o.tuning.cork && !o.local && !o.datagram;
+	rc.quickack = o.tuning.quickack && !o.local && !o.datagram;
+	int err = relay::run(kStringFdIn, kStringFdOut, socks[0], rc);
+	// What arrived is kept, even if the relay failed.
+	int closed = o.outFile != nullptr ? out.close() : 0;
+	if (err < 0) return fail("relay", err);
+	if (closed < 0) return fail("write", closed);
+	return 0;
+}
 
+} // namespace
+
+extern "C" void start(u64 *sp) {
+	init();
+	ignorePipe();
+	int argc = static_cast<int>(sp[0]);
+	char **argv = reinterpret_cast<char **>(&sp[1]);
+	int status = run(argc, argv);
 	fini();
-	syscall::call(syscall::Call::kExit, 1, 0, 0, 0, 0, 0);
+	syscall::exitGroup(status);
 }
@@ -0,0 +1,440 @@
+// Network sockets
+// depends on def.h, syscall.cc, mem.cc, string.cc
+// Defines Addr and Socket wrappers over the socket syscalls.
+
+namespace net {
+
+enum class Family : u16 {
+	kUnix  = 1,
+	kInet  = 2,
+	kInet6 = 10
+};
+
+// Socket types, may be or'd with kNonBlock
+enum class Type : int {
+	kStream   = 1,
+	kDgram    = 2,
+	kNonBlock = 04000
+};
+
+enum class Shut : int {
+	kRead,
+	kWrite,
+	kReadWrite
+};
+
+// Socket option levels and names
+enum class Level : int {
+	kSocket = 1,
+	kTcp    = 6
+};
+
+enum class Opt : int {
+	// Level::kSocket
+	kError         = 4,
+	kSndBuf        = 7,
+	kRcvBuf        = 8,
+	kBusyPoll      = 46,
+	kMaxPacingRate = 47,
+	kIncomingCpu   = 49,
+	kZeroCopy      = 60,
+	// Level::kTcp
+	kNoDelay       = 1,
+	kCork          = 3,
+	kQuickAck      = 12,
+	kNotSentLowAt  = 25
+};
+
+// Addr
+// Holds any socket address as raw bytes
+// along with its length, as the kernel takes it.
+class Addr {
+	friend class Socket;
+public:
+	// inet
+	// Makes an IPv4 address from host order ip and port.
+	static Addr inet(uint ip, u16 port);
+
+	// inet6
+	// Makes an IPv6 address from 16 network order bytes.
+	static Addr inet6(const u8 *ip, u16 port);
+
+	// parse
+	// Fills a from a dotted quad host and decimal port;
+	// a null host is the wildcard address.
+	// Returns false if either does not parse.
+	static bool parse(Addr *a, const char *host, const char *port);
+
+	// local
+	// Makes a unix domain address from a path;
+	// a leading @ names the abstract namespace.
+	// Returns false if the path is too long.
+	static bool local(Addr *a, const char *path);
+
+	// unnamed
+	// Makes a unix domain address with no name,
+	// binding it picks a free abstract name.
+	static Addr unnamed();
+
+	// path
+	// Returns the filesystem path of a unix address,
+	// or null for the abstract namespace and inet.
+	const char *path() const;
+
+	Family family() const;
+	const void *raw() const;
+	uint len() const;
+private:
+	u8 raw_[0x80] = {};
+	uint len_ = 0;
+};
+
+namespace {
+// sockaddr_in, fields in network byte order
+struct InetAddr {
+	u16 family;
+	u16 port;
+	uint addr;
+	u8 zero[8];
+};
+
+// sockaddr_in6
+struct Inet6Addr {
+	u16 family;
+	u16 port;
+	uint flowInfo;
+	u8 addr[16];
+	uint scope;
+};
+
+// sockaddr_un
+struct UnixAddr {
+	u16 family;
+	char path[108];
+};
+} // namespace
+
+// parseIp
+// Parses a dotted quad into a host order address.
+bool parseIp(string h, uint *ip) {
+	u64 start = 0, i, octets = 0;
+	uint addr = 0;
+	for (i = 0; i <= h.len; i++) {
+		if (i < h.len && h.buf[i] != '.') continue;
+		u64 octet;
+		if (!stringAsNum(string{&h.buf[start], i - start + 1, i - start}, &octet, 10) || octet > 0xff) {
+			return false;
+		}
+		addr = (addr << 8) | static_cast<uint>(octet);
+		octets++;
+		start = i + 1;
+	}
+	if (octets != 4) return false;
+	*ip = addr;
+	return true;
+}
+
+// parseIp6
+// Parses an IPv6 address, :: standing for a run of
+// zero groups, into 16 network order bytes.
+bool parseIp6(string h, u8 *ip) {
+	uint groups[8];
+	int n = 0, gap = -1;
+	u64 i = 0;
+	if (h.len >= 2 && h.buf[0] == ':' && h.buf[1] == ':') {
+		gap = 0;
+		i = 2;
+	}
+	while (i < h.len) {
+		u64 start = i;
+		uint g = 0;
+		for (; i < h.len && i - start < 4; i++) {
+			char c = h.buf[i];
+			uint d;
+			if (c >= '0' && c <= '9') d = static_cast<uint>(c - '0');
+			else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') d = static_cast<uint>((c | 0x20) - 'a' + 10);
+			else break;
+			g = g << 4 | d;
+		}
+		if (i == start || n == 8) return false;
+		groups[n++] = g;
+		if (i == h.len) break;
+		if (h.buf[i++] != ':' || i == h.len) return false;
+		if (h.buf[i] == ':') {
+			if (gap >= 0) return false;
+			gap = n;
+			i++;
+		}
+	}
+	if (gap < 0 ? n != 8 : n > 7) return false;
+	mem::zero(ip, 16);
+	int g, at = 0;
+	for (g = 0; g < n; g++) {
+		if (g == gap) at = 8 - (n - g);
+		ip[2 * at] = static_cast<u8>(groups[g] >> 8);
+		ip[2 * at + 1] = static_cast<u8>(groups[g]);
+		at++;
+	}
+	return true;
+}
+
+// parsePort
+// Parses a decimal port number.
+bool parsePort(const char *s, u16 *port) {
+	u64 p;
+	if (!stringAsNum(fromNullTermString(s), &p, 10) || p > 0xffff) return false;
+	*port = static_cast<u16>(p);
+	return true;
+}
+
+Addr Addr::inet(uint ip, u16 port) {
+	Addr a;
+	InetAddr in = {static_cast<u16>(Family::kInet), port, ip, {}};
+	mem::upend(&in.port, sizeof in.port);
+	mem::upend(&in.addr, sizeof in.addr);
+	memcpy(a.raw_, &in, sizeof in);
+	a.len_ = sizeof in;
+	return a;
+}
+
+Addr Addr::inet6(const u8 *ip, u16 port) {
+	Addr a;
+	Inet6Addr in = {static_cast<u16>(Family::kInet6), port, 0, {}, 0};
+	mem::upend(&in.port, sizeof in.port);
+	memcpy(in.addr, ip, sizeof in.addr);
+	memcpy(a.raw_, &in, sizeof in);
+	a.len_ = sizeof in;
+	return a;
+}
+
+bool Addr::parse(Addr *a, const char *host, const char *port) {
+	u16 p;
+	if (!parsePort(port, &p)) return false;
+
+	uint ip = 0;
+	if (host != nullptr && !parseIp(fromNullTermString(host), &ip)) return false;
+	*a = inet(ip, p);
+	return true;
+}
+
+bool Addr::local(Addr *a, const char *path) {
+	UnixAddr un = {static_cast<u16>(Family::kUnix), {}};
+	string p = fromNullTermString(path);
+	if (p.len == 0 || p.len >= sizeof un.path) return false;
+	memcpy(un.path, p.buf, p.len);
+	// Abstract names are not null terminated,
+	// their length is all the kernel goes by.
+	u64 len = sizeof un.family + p.len + 1;
+	if (un.path[0] == '@') {
+		un.path[0] = '\0';
+		len--;
+	}
+	*a = Addr();
+	memcpy(a->raw_, &un, sizeof un);
+	a->len_ = static_cast<uint>(len);
+	return true;
+}
+
+Addr Addr::unnamed() {
+	Addr a;
+	u16 family = static_cast<u16>(Family::kUnix);
+	memcpy(a.raw_, &family, sizeof family);
+	a.len_ = sizeof family;
+	return a;
+}
+
+const char *Addr::path() const {
+	if (family() != Family::kUnix || raw_[sizeof(u16)] == '\0') return nullptr;
+	return reinterpret_cast<const char *>(&raw_[sizeof(u16)]);
+}
+
+Family Addr::family() const {
+	return static_cast<Family>(raw_[0] | raw_[1] << 8);
+}
+
+const void *Addr::raw() const {
+	return raw_;
+}
+
+uint Addr::len() const {
+	return len_;
+}
+
+// Socket
+// Owns a socket file descriptor.
+// Methods wrap the respective syscalls, see their
+// man pages; errors are returned as negated errno.
+class Socket {
+public:
+	Socket() {}
+	explicit Socket(int fd) : fd_(fd) {}
+
+	static Socket open(Family f, int type);
+	int connect(const Addr &a);
+	int bind(const Addr &a);
+	int listen(int backlog);
+	Socket accept(int flags);
+	int shutdown(Shut how);
+	int nonBlock();
+	// block
+	// Undoes nonBlock.
+	int block();
+	int setOpt(Level level, Opt opt, int value);
+	// setOpt64
+	// For options the kernel reads as a long when given one.
+	int setOpt64(Level level, Opt opt, u64 value);
+	int getOpt(Level level, Opt opt, int *value);
+
+	// recvFrom
+	// Reads one datagram, storing its sender in from.
+	i64 recvFrom(void *buf, u64 len, Addr *from);
+	int close();
+
+	// Returns the descriptor, or the negated errno
+	// if the socket failed to open or accept.
+	int fd() const;
+	bool ok() const;
+private:
+	int fd_ = -1;
+};
+
+Socket Socket::open(Family f, int type) {
+	return Socket(syscall::socket(static_cast<int>(f), type, 0));
+}
+
+int Socket::connect(const Addr &a) {
+	return syscall::connect(fd_, a.raw(), a.len());
+}
+
+int Socket::bind(const Addr &a) {
+	return syscall::bind(fd_, a.raw(), a.len());
+}
+
+int Socket::listen(int backlog) {
+	return syscall::listen(fd_, backlog);
+}
+
+Socket Socket::accept(int flags) {
+	return Socket(syscall::accept4(fd_, nullptr, nullptr, flags));
+}
+
+int Socket::shutdown(Shut how) {
+	return syscall::shutdown(fd_, static_cast<int>(how));
+}
+
+int Socket::setOpt(Level level, Opt opt, int value) {
+	return syscall::setsockopt(fd_, static_cast<int>(level), static_cast<int>(opt), &value, sizeof value);
+}
+
+int Socket::setOpt64(Level level, Opt opt, u64 value) {
+	return syscall::setsockopt(fd_, static_cast<int>(level), static_cast<int>(opt), &value, sizeof value);
+}
+
+int Socket::getOpt(Level level, Opt opt, int *value) {
+	uint len = sizeof *value;
+	return syscall::getsockopt(fd_, static_cast<int>(level), static_cast<int>(opt), value, &len);
+}
+
+i64 Socket::recvFrom(void *buf, u64 len, Addr *from) {
+	*from = Addr();
+	from->len_ = sizeof from->raw_;
+	return syscall::recvfrom(fd_, buf, len, 0, from->raw_, &from->len_);
+}
+
+int Socket::nonBlock() {
+	i64 flags = syscall::fcntl(fd_, syscall::kFcntlGetFlags, 0);
+	if (flags < 0) return static_cast<int>(flags);
+	flags |= static_cast<int>(Type::kNonBlock);
+	return static_cast<int>(syscall::fcntl(fd_, syscall::kFcntlSetFlags, static_cast<u64>(flags)));
+}
+
+int Socket::block() {
+	i64 flags = syscall::fcntl(fd_, syscall::kFcntlGetFlags, 0);
+	if (flags < 0) return static_cast<int>(flags);
+	flags &= ~static_cast<i64>(Type::kNonBlock);
+	return static_cast<int>(syscall::fcntl(fd_, syscall::kFcntlSetFlags, static_cast<u64>(flags)));
+}
+
+int Socket::close() {
+	int r = syscall::close(fd_);
+	fd_ = -1;
+	return r;
+}
+
+int Socket::fd() const {
+	return fd_;
+}
+
+bool Socket::ok() const {
+	return fd_ >= 0;
+}
+
+// Tuning
+// Socket options from the command line. Zero leaves the
+// kernel default, as does kAnyCpu for the incoming cpu.
+// Latency sensitive request and response traffic wants
+// nodelay and quickack, bulk transfers cork and big buffers.
+class Tuning {
+public:
+	enum : u64 {
+		kAnyCpu = ~0ull,
+		kMaxInt = 0x7fffffff // largest value of the int options
+	};
+
+	// valid
+	// Reports whether the options the kernel takes
+	// as an int fit one.
+	bool valid() const;
+
+	// apply
+	// Sets the options on s, skipping TCP options unless
+	// tcp is set. Returns 0 or the first negated errno.
+	int apply(Socket s, bool tcp) const;
+
+	bool nodelay = false;
+	bool cork = false;
+	bool quickack = false;
+	u64 sndbuf = 0;
+	u64 rcvbuf = 0;
+	u64 busyPoll = 0;     // microseconds
+	u64 notSentLowAt = 0; // bytes
+	u64 incomingCpu = kAnyCpu;
+	u64 maxPacingRate = 0; // bytes per second
+};
+
+bool Tuning::valid() const {
+	return sndbuf <= kMaxInt && rcvbuf <= kMaxInt && busyPoll <= kMaxInt && notSentLowAt <= kMaxInt &&
+		(incomingCpu == kAnyCpu || incomingCpu <= kMaxInt);
+}
+
+int Tuning::apply(Socket s, bool tcp) const {
+	struct {
+		bool set;
+		Level level;
+		Opt opt;
+		u64 value;
+	} opts[] = {
+		{sndbuf != 0, Level::kSocket, Opt::kSndBuf, sndbuf},
+		{rcvbuf != 0, Level::kSocket, Opt::kRcvBuf, rcvbuf},
+		{busyPoll != 0, Level::kSocket, Opt::kBusyPoll, busyPoll},
+		{incomingCpu != kAnyCpu, Level::kSocket, Opt::kIncomingCpu, incomingCpu},
+		{nodelay, Level::kTcp, Opt::kNoDelay, 1},
+		{cork, Level::kTcp, Opt::kCork, 1},
+		{quickack, Level::kTcp, Opt::kQuickAck, 1},
+		{notSentLowAt != 0, Level::kTcp, Opt::kNotSentLowAt, notSentLowAt},
+	};
+	u64 i;
+	for (i = 0; i < sizeof opts / sizeof opts[0]; i++) {
+		if (!opts[i].set) continue;
+		if (opts[i].level == Level::kTcp && !tcp) continue;
+		int err = s.setOpt(opts[i].level, opts[i].opt, static_cast<int>(opts[i].value));
+		if (err < 0) return err;
+	}
+	// TCP paces itself, with or without the fq qdisc, since
+	// Linux 4.13. Other sockets are only paced under fq, so
+	// the relay paces those itself.
+	if (tcp && maxPacingRate != 0) return s.setOpt64(Level::kSocket, Opt::kMaxPacingRate, maxPacingRate);
+	return 0;
+}
+
+} // namespace net
@@ -0,0 +1,66 @@
+// Pacing
+// depends on def.h, time.cc
+// Token bucket capping the send rate of sockets the kernel
+// does not pace. Credit is kept as a time instead of a byte
+// count: the moment everything sent so far is paid for at
+// the rate. Idle time earns at most a burst, and a send that
+// is not yet paid for sleeps on an absolute deadline, so the
+// rate holds to the nanosecond without polling the clock.
+
+namespace pace {
+
+enum : u64 {
+	kMinBurst = 1500,      // a full Ethernet frame
+	kMaxRate  = 1ull << 34 // past it a second's nanoseconds times the rate overflows
+};
+
+// Bucket
+// Allows rate bytes a second, at most burst at once.
+class Bucket {
+public:
+	// init
+	// Sets rate in bytes a second, at most kMaxRate, and burst
+	// in bytes, 0 for a millisecond's worth and at most a second's.
+	void init(u64 rate, u64 burst);
+
+	// take
+	// Waits until n bytes may be sent and spends them.
+	void take(u64 n);
+
+	u64 burst() const;
+private:
+	u64 cost(u64 n) const;
+
+	u64 rate_ = 0;
+	u64 burst_ = 0;
+	u64 paid_ = 0; // clock time up to which sends are paid for
+};
+
+void Bucket::init(u64 rate, u64 burst) {
+	rate_ = rate;
+	burst_ = burst != 0 ? burst : rate / 1000;
+	if (burst_ > rate) burst_ = rate;
+	if (burst_ < kMinBurst) burst_ = kMinBurst;
+	paid_ = 0;
+}
+
+u64 Bucket::burst() const {
+	return burst_;
+}
+
+// cost
+// Returns the nanoseconds n bytes take at the rate. Whole
+// seconds are split off so the product stays within u64.
+u64 Bucket::cost(u64 n) const {
+	return n / rate_ * time::kSecond + n % rate_ * time::kSecond / rate_;
+}
+
+void Bucket::take(u64 n) {
+	u64 now = time::now();
+	u64 full = cost(burst_);
+	if (paid_ + full < now) paid_ = now - full;
+	paid_ += cost(n);
+	if (paid_ > now) time::sleepUntil(paid_);
+}
+
+} // namespace pace
@@ -0,0 +1,397 @@
+// Relay
+// depends on def.h, syscall.cc, sync.cc, thread.cc, string.cc, io.cc, net.cc, zcopy.cc, dump.cc, line.cc, lz4.cc, crc.cc, pace.cc, disk.cc
+// Copies data both ways between standard io and a socket.
+
+namespace relay {
+
+enum {
+	kBufSize  = zcopy::kSlotSize,
+	kCorkIdle = 1, // milliseconds without input before uncorking
+	kDumpIdle = 1, // and before writing out buffered dump lines
+	kDiskIdle = 50 // and before writing a part full file buffer
+};
+
+// Config
+// Per socket behaviour of the relay.
+class Config {
+public:
+	bool zerocopy = false; // send large writes with MSG_ZEROCOPY
+	bool cork = false;     // socket is corked, flush it when input idles
+	bool quickack = false; // rearm TCP_QUICKACK after every read
+	bool lz4 = false;      // socket data is an LZ4 frame both ways
+	bool checksum = false; // report the CRC32C of each direction at the end
+	bool threads = false;  // run each direction on its own thread
+	u64 rate = 0;          // pace sent data to bytes a second, 0 for no pacing
+	u64 burst = 0;         // most bytes paced out at once, 0 for the default
+	dump::Log *log = nullptr; // traffic dump, null for none
+	line::Filter *filter = nullptr; // line processing of sent data, null for none
+	disk::Writer *disk = nullptr;   // file taking received data instead of out, null for none
+};
+
+// Half
+// One direction of the relay, from one
+// descriptor to another.
+class Half {
+public:
+	Half(int f, int t, dump::Dir d) : from(f), to(t), dir(d) {}
+
+	// pump
+	// Reads once from from and writes all of it to to.
+	// Returns bytes moved, 0 at end of file or the negated errno.
+	i64 pump();
+
+	int from;
+	int to;
+	dump::Dir dir;
+	bool eof = false;
+	// Zero copy sender for the socket, null to copy.
+	zcopy::Sender *zc = nullptr;
+	dump::Log *log = nullptr;
+	sync::Mutex *lock = nullptr; // held while logging, null unthreaded
+	line::Filter *filter = nullptr;
+	// Compression of what is written, decompression
+	// of what is read, null for none.
+	lz4::Encoder *enc = nullptr;
+	lz4::Decoder *dec = nullptr;
+	// Checksum of the data as it is on either end.
+	crc::Sum *sum = nullptr;
+	// Pacing of what is written, null for none.
+	pace::Bucket *bucket = nullptr;
+	// File written in place of to, null for none.
+	disk::Writer *disk = nullptr;
+private:
+	int process(const u8 *b, u64 len);
+	int finish();
+	int forward(const u8 *b, u64 len);
+	int write(const u8 *b, u64 len);
+
+	u8 buf[kBufSize];
+};
+
+// write
+// Writes all of b to to once the bucket allows it.
+int Half::write(const u8 *b, u64 len) {
+	if (disk != nullptr) return disk->write(b, len);
+	if (bucket != nullptr) bucket->take(len);
+	return io::writeAll(to, b, len);
+}
+
+// forward
+// Logs len bytes of b and writes them out,
+// compressed a block at a time with enc.
+int Half::forward(const u8 *b, u64 len) {
+	if (log != nullptr) {
+		if (lock != nullptr) lock->lock();
+		int err = log->write(dir, b, len);
+		if (lock != nullptr) lock->unlock();
+		if (err < 0) return err;
+	}
+	if (sum != nullptr) sum->update(b, len);
+	if (zc != nullptr) return zc->sendAll(b, len);
+	if (enc == nullptr) return write(b, len);
+	while (len > 0) {
+		u64 n = len < lz4::kBlockSize ? len : static_cast<u64>(lz4::kBlockSize);
+		const u8 *out;
+		u64 m = enc->block(b, n, &out);
+		int err = write(out, m);
+		if (err < 0) return err;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// process
+// Runs a read through the filters and passes it on.
+int Half::process(const u8 *b, u64 len) {
+	const u8 *out = b;
+	if (filter != nullptr) len = filter->run(b, len, &out);
+	if (dec == nullptr) return forward(out, len);
+	dec->push(out, len);
+	i64 n;
+	while ((n = dec->next(&out)) > 0) {
+		int err = forward(out, static_cast<u64>(n));
+		if (err < 0) return err;
+	}
+	return static_cast<int>(n);
+}
+
+// finish
+// Passes on what the filters held back at end of file.
+int Half::finish() {
+	const u8 *rest;
+	// A partial line held back for its newline.
+	u64 len = filter != nullptr ? filter->finish(&rest) : 0;
+	int err = len > 0 ? forward(rest, len) : 0;
+	if (err == 0 && enc != nullptr) {
+		len = enc->end(&rest);
+		err = write(rest, len);
+	}
+	// A frame cut short, or none at all.
+	if (err == 0 && dec != nullptr && !dec->ended()) err = -syscall::kEBadMsg;
+	return err;
+}
+
+i64 Half::pump() {
+	// Zero copy sends need a buffer the kernel is done with.
+	u8 *b = buf;
+	if (zc != nullptr && (b = zc->buffer()) == nullptr) return -syscall::kENoMem;
+	// Paced, read no more than a burst, so one read
+	// goes out at once rather than as a run of sleeps.
+	u64 max = bucket != nullptr && bucket->burst() < kBufSize ? bucket->burst() : static_cast<u64>(kBufSize);
+	// Unless the data changes on the way, a file
+	// takes it where it is read to, as large as fits.
+	if (disk != nullptr && filter == nullptr && dec == nullptr) b = disk->space(&max);
+	i64 n = syscall::read(from, b, max);
+	int err = 0;
+	if (n > 0) err = process(b, static_cast<u64>(n));
+	else if (n == 0) err = finish();
+	if (n <= 0 || err < 0) eof = true;
+	return err < 0 ? err : n;
+}
+
+namespace {
+// report
+// Writes each direction's byte count and CRC32C to stderr.
+void report(const crc::Sum *sums) {
+	const char *names[] = {"sent", "received"};
+	char buf[0x80];
+	string str = newString(buf, sizeof buf);
+	int i;
+	for (i = 0; i < 2; i++) {
+		str = formatString(str, "nc: ", names[i], ' ', dec(sums[i].bytes()), " bytes, crc32c ", hex(sums[i].value(), 8), '\n');
+	}
+	writeString(str, kStringFdErr);
+}
+
+// Sides
+// Both halves and what they send and receive through.
+// With threads it is allocated and shared by both.
+class Sides {
+public:
+	Sides(int in, int out, net::Socket s)
+		: send(in, s.fd(), dump::Dir::kSent), recv(s.fd(), out, dump::Dir::kReceived), sock(s), zc(s) {}
+
+	// init
+	// Sets the halves up as c asks.
+	// Returns 0 or the negated errno.
+	int init(const Config &c);
+
+	Half send;
+	Half recv;
+	net::Socket sock;
+	zcopy::Sender zc;
+	lz4::Encoder enc;
+	lz4::Decoder dec;
+	crc::Sum sums[2];
+	pace::Bucket bucket;
+	bool cork = false;
+	// Guards the log once the halves are on two threads.
+	sync::Mutex logLock;
+	thread::Thread sender;
+	int err = 0; // of the send thread
+	int wake[2] = {-1, -1}; // pipe written to stop the send thread
+};
+
+int Sides::init(const Config &c) {
+	send.log = recv.log = c.log;
+	send.filter = c.filter;
+	recv.disk = c.disk;
+	cork = c.cork;
+	if (c.lz4) {
+		int r = enc.init();
+		if (r == 0) r = dec.init();
+		if (r < 0) return r;
+		send.enc = &enc;
+		recv.dec = &dec;
+	}
+	if (c.checksum) {
+		crc::init();
+		send.sum = &sums[0];
+		recv.sum = &sums[1];
+	}
+	if (c.rate != 0) {
+		bucket.init(c.rate, c.burst);
+		send.bucket = &bucket;
+	}
+	// Filtered data is sent from the filter's buffers,
+	// which are reused without waiting on completions.
+	if (c.zerocopy && c.filter == nullptr && !c.lz4 && c.rate == 0 && zc.enable() == 0) send.zc = &zc;
+	return 0;
+}
+
+// sendLoop
+// Runs the send half on its own thread until end of input
+// or the wake pipe stops it. Corked, it waits for input
+// with a timeout so it can flush when it idles.
+void sendLoop(void *p) {
+	Sides *s = static_cast<Sides *>(p);
+	bool corked = false;
+	for (;;) {
+		io::PollFd fds[2] = {{s->send.from, io::kIn, 0}, {s->wake[0], io::kIn, 0}};
+		int r = io::poll(fds, 2, corked ? kCorkIdle : -1);
+		if (r < 0 && syscall::err(r) == syscall::kEIntr) continue;
+		if (r < 0) {
+			s->err = r;
+			return;
+		}
+		if (fds[1].revents != 0) return;
+		if (r == 0) {
+			s->sock.setOpt(net::Level::kTcp, net::Opt::kCork, 0);
+			s->sock.setOpt(net::Level::kTcp, net::Opt::kCork, 1);
+			corked = false;
+			continue;
+		}
+		i64 m = s->send.pump();
+		if (m < 0) {
+			s->err = static_cast<int>(m);
+			return;
+		}
+		if (m == 0) {
+			s->sock.shutdown(net::Shut::kWrite);
+			return;
+		}
+		corked = s->cork;
+	}
+}
+
+// runThreads
+// Relays with the send half on a second thread and the
+// receive half on this one. The threads only share the log.
+int runThreads(int in, int out, net::Socket sock, const Config &c) {
+	int err = thread::init();
+	if (err < 0) return err;
+	Sides *s = new Sides(in, out, sock);
+	if (s == nullptr) return -syscall::kENoMem;
+	err = s->init(c);
+	if (err == 0 && c.log != nullptr) s->send.lock = s->recv.lock = &s->logLock;
+	if (err == 0) err = syscall::pipe2(s->wake, io::kCloseExec);
+	bool started = false;
+	if (err == 0) started = (err = s->sender.start(sendLoop, s)) == 0;
+
+	while (err == 0 && !s->recv.eof) {
+		bool dumped = false;
+		if (c.log != nullptr) {
+			sync::Lock l(&s->logLock);
+			dumped = c.log->pending();
+		}
+		bool stored = c.disk != nullptr && c.disk->pending();
+		if (dumped || stored) {
+			// Lines and file data go out once the socket pauses.
+			io::PollFd fd = {sock.fd(), io::kIn, 0};
+			int r = io::poll(&fd, 1, dumped ? kDumpIdle : kDiskIdle);
+			if (r == 0 && stored) r = c.disk->flush();
+			if (r == 0 && dumped) {
+				sync::Lock l(&s->logLock);
+				r = c.log->flush();
+			}
+			if (r < 0) {
+				err = r;
+				break;
+			}
+			if (r == 0) continue;
+		}
+		i64 m = s->recv.pump();
+		if (m < 0) err = static_cast<int>(m);
+		if (m > 0 && c.quickack) sock.setOpt(net::Level::kTcp, net::Opt::kQuickAck, 1);
+	}
+	if (started) {
+		// The peer closing its side leaves ours open, so the
+		// rest of the input still goes out. On an error the
+		// sender is stopped instead, whether it waits on
+		// input or on a socket write.
+		if (err < 0) {
+			u8 b = 0;
+			syscall::write(s->wake[1], &b, 1);
+			sock.shutdown(net::Shut::kReadWrite);
+		}
+		s->sender.join();
+		if (err == 0) err = s->err;
+	}
+	if (err == 0 && c.checksum) report(s->sums);
+	if (c.log != nullptr) {
+		int r = c.log->flush();
+		if (err == 0) err = r;
+	}
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (s->wake[i] >= 0) syscall::close(s->wake[i]);
+	}
+	delete s;
+	return err;
+}
+} // namespace
+
+// run
+// Relays in to sock and sock to out until both reach end
+// of file. When in does the socket's write side is shut
+// down so the peer sees it as well.
+// Returns 0 or the negated errno.
+int run(int in, int out, net::Socket sock, const Config &c) {
+	if (c.threads) return runThreads(in, out, sock, c);
+	Sides s(in, out, sock);
+	int err = s.init(c);
+	if (err < 0) return err;
+	Half &send = s.send, &recv = s.recv;
+	Half *halves[] = {&send, &recv};
+	// Corked data sent since the last flush.
+	bool corked = false;
+
+	while (!recv.eof || !send.eof) {
+		io::PollFd fds[2];
+		Half *polled[2];
+		u64 n = 0, i;
+		for (i = 0; i < 2; i++) {
+			if (halves[i]->eof) continue;
+			polled[n] = halves[i];
+			fds[n++] = io::PollFd{halves[i]->from, io::kIn, 0};
+		}
+		bool dumped = c.log != nullptr && c.log->pending();
+		bool stored = c.disk != nullptr && c.disk->pending();
+		int r = io::poll(fds, n, corked ? kCorkIdle : dumped ? kDumpIdle : stored ? kDiskIdle : -1);
+		if (r < 0) return r;
+		if (r == 0 && stored) {
+			// Received data reaches the file once the
+			// socket pauses, not only as buffers fill.
+			r = c.disk->flush();
+			if (r < 0) return r;
+			if (!corked && !dumped) continue;
+		}
+		if (r == 0 && dumped) {
+			// Lines wait for a full buffer while data
+			// flows, and go out once it pauses.
+			r = c.log->flush();
+			if (r < 0) return r;
+			if (!corked) continue;
+		}
+		if (r == 0) {
+			// Input went idle, pulling the cork pushes out
+			// the partial segment instead of waiting 200ms.
+			sock.setOpt(net::Level::kTcp, net::Opt::kCork, 0);
+			sock.setOpt(net::Level::kTcp, net::Opt::kCork, 1);
+			corked = false;
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (fds[i].revents == 0) continue;
+			// Completions raise errors on the socket
+			// without making it readable.
+			if (polled[i] == &recv && (fds[i].revents & io::kErr) && send.zc != nullptr) {
+				if (s.zc.reap() > 0 && !(fds[i].revents & (io::kIn | io::kHup))) continue;
+			}
+			i64 m = polled[i]->pump();
+			if (m < 0) return static_cast<int>(m);
+			if (m == 0 && polled[i] == &send) sock.shutdown(net::Shut::kWrite);
+			if (m > 0 && polled[i] == &send) corked = c.cork;
+			// The kernel drops out of quickack mode on its own.
+			if (m > 0 && polled[i] == &recv && c.quickack) {
+				sock.setOpt(net::Level::kTcp, net::Opt::kQuickAck, 1);
+			}
+		}
+	}
+	if (c.checksum) report(s.sums);
+	return c.log != nullptr ? c.log->flush() : 0;
+}
+
+} // namespace relay
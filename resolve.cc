@@ -0,0 +1,686 @@
+// Resolver
+// depends on def.h, syscall.cc, mem.cc, string.cc, time.cc, io.cc, net.cc
+// Host names to addresses without libc. /etc/hosts is mapped
+// and indexed on first use, and names it lacks are asked of
+// the nameservers in /etc/resolv.conf, the A and AAAA queries
+// going out together on one UDP socket. Answers, and denials
+// carrying an SOA, are cached for their TTL, so a scan or a
+// run of connects resolves each name once. connect tries the
+// addresses found happy eyeballs style, RFC 8305.
+
+namespace resolve {
+
+enum {
+	kMaxIps     = 8,   // addresses kept per name
+	kMaxServers = 3,   // as many as resolv.conf may name
+	kCacheSize  = 0x40 // names, direct mapped
+};
+
+enum : u64 {
+	kAttemptDelay = 250 * time::kMillisecond // between connection attempts
+};
+
+// Ip
+// An address without a port, bytes in network order.
+class Ip {
+public:
+	net::Addr addr(u16 port) const;
+
+	net::Family family = net::Family::kInet;
+	u8 bytes[16] = {};
+};
+
+net::Addr Ip::addr(u16 port) const {
+	if (family == net::Family::kInet6) return net::Addr::inet6(bytes, port);
+	return net::Addr::inet(static_cast<uint>(bytes[0]) << 24 | static_cast<uint>(bytes[1]) << 16 |
+		static_cast<uint>(bytes[2]) << 8 | bytes[3], port);
+}
+
+// Result
+// Addresses of a name, alternating between families
+// from IPv6 on, the order to try them in.
+class Result {
+public:
+	Ip ip[kMaxIps];
+	int n = 0;
+};
+
+// Config
+// Where to look. A server, if set, is asked instead
+// of those in resolv.conf.
+class Config {
+public:
+	const char *hosts = "/etc/hosts";
+	const char *resolvConf = "/etc/resolv.conf";
+	net::Addr server;
+};
+
+namespace {
+enum : uint {
+	kTypeA    = 1,
+	kTypeSoa  = 6,
+	kTypeAaaa = 28,
+	kClassIn  = 1
+};
+
+// Header flags
+enum : uint {
+	kResponse  = 0x8000,
+	kRecursion = 0x100,
+	kRcode     = 0xf,
+	kNxDomain  = 3
+};
+
+enum {
+	kDnsPort    = 53,
+	kHeaderSize = 12,
+	kMaxMessage = 512, // all a plain UDP answer may hold
+	kMaxName    = 253,
+	kMaxLabel   = 63,
+	kSeekEnd    = 2,
+	kConfSize   = 0x1000,
+	kTimeout    = 5, // seconds per try, as resolv.conf defaults
+	kAttempts   = 2
+};
+
+u16 get16(const u8 *p) {
+	return static_cast<u16>(p[0] << 8 | p[1]);
+}
+
+uint get32(const u8 *p) {
+	return static_cast<uint>(p[0]) << 24 | static_cast<uint>(p[1]) << 16 | static_cast<uint>(p[2]) << 8 | p[3];
+}
+
+char lower(char c) {
+	return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+}
+
+// same
+// Compares names ignoring ASCII case, as DNS does.
+bool same(const char *a, const char *b, u64 len) {
+	u64 i;
+	for (i = 0; i < len; i++) {
+		if (lower(a[i]) != lower(b[i])) return false;
+	}
+	return true;
+}
+
+// is
+// Reports whether w is the word s.
+bool is(string w, const char *s) {
+	u64 i;
+	for (i = 0; i < w.len && s[i] != '\0'; i++) {
+		if (w.buf[i] != s[i]) return false;
+	}
+	return i == w.len && s[i] == '\0';
+}
+
+// option
+// Sets *v from a resolv.conf option word if it is
+// name followed by a count from 1 to 30.
+void option(string w, const char *name, int *v) {
+	u64 len = fromNullTermString(name).len, n;
+	if (w.len <= len || !same(w.buf, name, len)) return;
+	if (stringAsNum(string{&w.buf[len], w.size - len, w.len - len}, &n, 10) && n >= 1 && n <= 30) *v = static_cast<int>(n);
+}
+
+// hash
+// FNV-1a of the lower cased name.
+uint hash(string name) {
+	uint h = 2166136261u;
+	u64 i;
+	for (i = 0; i < name.len; i++) h = (h ^ static_cast<u8>(lower(name.buf[i]))) * 16777619u;
+	return h;
+}
+
+// literal
+// Parses a numeric IPv4 or IPv6 address.
+bool literal(string s, Ip *ip) {
+	uint v4;
+	if (net::parseIp(s, &v4)) {
+		ip->family = net::Family::kInet;
+		ip->bytes[0] = static_cast<u8>(v4 >> 24);
+		ip->bytes[1] = static_cast<u8>(v4 >> 16);
+		ip->bytes[2] = static_cast<u8>(v4 >> 8);
+		ip->bytes[3] = static_cast<u8>(v4);
+		return true;
+	}
+	if (!net::parseIp6(s, ip->bytes)) return false;
+	ip->family = net::Family::kInet6;
+	return true;
+}
+
+// add
+// Appends ip to r unless r is full or has it already.
+void add(Result *r, const Ip &ip) {
+	int i;
+	for (i = 0; i < r->n; i++) {
+		const Ip &o = r->ip[i];
+		u64 b;
+		for (b = 0; b < sizeof ip.bytes && o.bytes[b] == ip.bytes[b]; b++) {}
+		if (o.family == ip.family && b == sizeof ip.bytes) return;
+	}
+	if (r->n < kMaxIps) r->ip[r->n++] = ip;
+}
+
+// interleave
+// Puts r in the order connect tries it: IPv6 first,
+// then taking turns between the families.
+void interleave(Result *r) {
+	Ip v6[kMaxIps], v4[kMaxIps];
+	int n6 = 0, n4 = 0, i;
+	for (i = 0; i < r->n; i++) {
+		if (r->ip[i].family == net::Family::kInet6) v6[n6++] = r->ip[i];
+		else v4[n4++] = r->ip[i];
+	}
+	int a = 0, b = 0;
+	for (i = 0; i < r->n; i++) {
+		bool six = a < n6 && (b == n4 || i % 2 == 0);
+		r->ip[i] = six ? v6[a++] : v4[b++];
+	}
+}
+
+// Lines
+// Walks text line by line and each line word by
+// word, leaving out # and ; comments.
+class Lines {
+public:
+	Lines(const char *text, u64 len) : text_(text), len_(len) {}
+
+	// next
+	// Moves to the next line, false past the last.
+	bool next();
+
+	// word
+	// Fills the line's next word, false past the last.
+	bool word(string *w);
+private:
+	const char *text_;
+	u64 len_;
+	u64 end_ = 0;   // the line's newline
+	u64 limit_ = 0; // where its words end
+	u64 at_ = 0;
+	bool started_ = false;
+};
+
+bool Lines::next() {
+	u64 start = started_ ? end_ + 1 : 0;
+	started_ = true;
+	if (start >= len_) return false;
+	for (end_ = start; end_ < len_ && text_[end_] != '\n'; end_++) {}
+	for (limit_ = start; limit_ < end_ && text_[limit_] != '#' && text_[limit_] != ';'; limit_++) {}
+	at_ = start;
+	return true;
+}
+
+bool Lines::word(string *w) {
+	while (at_ < limit_ && (text_[at_] == ' ' || text_[at_] == '\t' || text_[at_] == '\r')) at_++;
+	if (at_ == limit_) return false;
+	u64 start = at_;
+	while (at_ < limit_ && text_[at_] != ' ' && text_[at_] != '\t' && text_[at_] != '\r') at_++;
+	*w = string{const_cast<char *>(&text_[start]), at_ - start + 1, at_ - start};
+	return true;
+}
+
+// Hosts
+// /etc/hosts mapped read only, and an open addressing
+// table of its names pointing into the mapping.
+class Hosts {
+public:
+	// load
+	// Maps and indexes the file; a missing one is empty.
+	void load(const char *path);
+
+	// find
+	// Adds the addresses listed for name to r.
+	void find(string name, Result *r) const;
+private:
+	struct Entry {
+		const char *name; // null in a free slot
+		u64 len;
+		Ip ip;
+	};
+
+	// index
+	// Counts the names in the file, entering
+	// them into table as well if given one.
+	u64 index(Entry *table, u64 mask) const;
+
+	const char *text_ = nullptr;
+	u64 len_ = 0;
+	Entry *table_ = nullptr;
+	u64 mask_ = 0;
+};
+
+void Hosts::load(const char *path) {
+	int fd = io::open(path, io::kReadOnly | io::kCloseExec, 0);
+	if (fd < 0) return;
+	i64 size = syscall::lseek(fd, 0, kSeekEnd);
+	if (size > 0) {
+		void *m = mem::MMap::map(nullptr, static_cast<u64>(size), static_cast<u64>(mem::MMap::Prot::kRead),
+			static_cast<u64>(mem::MMap::Flag::kPrivate), fd, 0);
+		if (!syscall::err(reinterpret_cast<i64>(m))) {
+			text_ = static_cast<const char *>(m);
+			len_ = static_cast<u64>(size);
+		}
+	}
+	syscall::close(fd);
+	if (text_ == nullptr) return;
+	u64 n = index(nullptr, 0), slots = 0x10;
+	while (slots < 2 * n) slots <<= 1;
+	table_ = static_cast<Entry *>(mem::pages(slots * sizeof(Entry)));
+	if (table_ == nullptr) return;
+	mask_ = slots - 1;
+	index(table_, mask_);
+}
+
+u64 Hosts::index(Entry *table, u64 mask) const {
+	Lines lines(text_, len_);
+	u64 n = 0;
+	string w;
+	while (lines.next()) {
+		Ip ip;
+		if (!lines.word(&w) || !literal(w, &ip)) continue;
+		while (lines.word(&w)) {
+			n++;
+			if (table == nullptr) continue;
+			u64 i = hash(w) & mask;
+			while (table[i].name != nullptr) i = (i + 1) & mask;
+			table[i] = Entry{w.buf, w.len, ip};
+		}
+	}
+	return n;
+}
+
+void Hosts::find(string name, Result *r) const {
+	if (table_ == nullptr) return;
+	u64 i;
+	for (i = hash(name) & mask_; table_[i].name != nullptr; i = (i + 1) & mask_) {
+		const Entry &e = table_[i];
+		if (e.len == name.len && same(e.name, name.buf, name.len)) add(r, e.ip);
+	}
+}
+
+// Question
+// A query as sent and what its answers said, with the
+// least TTL among them; ~0 if nothing says how long
+// the outcome may be cached.
+struct Question {
+	u8 query[kMaxMessage];
+	u64 len;
+	uint type;
+	bool answered;
+	uint ttl;
+	Result result;
+};
+
+enum class Reply {
+	kIgnored, // not for this question
+	kTaken,
+	kFailed   // the server could not answer it
+};
+
+// ask
+// Writes a recursive query for name of type into q.
+// Returns false if name is not a valid DNS name.
+bool ask(Question *q, string name, uint type) {
+	u16 id;
+	if (syscall::getrandom(&id, sizeof id, 0) != static_cast<i64>(sizeof id)) id = static_cast<u16>(time::now());
+	u8 *m = q->query;
+	mem::zero(m, kHeaderSize);
+	m[0] = static_cast<u8>(id >> 8);
+	m[1] = static_cast<u8>(id);
+	m[2] = kRecursion >> 8;
+	m[5] = 1;
+	u64 p = kHeaderSize, start = 0, i;
+	for (i = 0; i <= name.len; i++) {
+		if (i < name.len && name.buf[i] != '.') continue;
+		u64 len = i - start;
+		if (len == 0 || len > kMaxLabel) return false;
+		m[p++] = static_cast<u8>(len);
+		memcpy(&m[p], &name.buf[start], len);
+		p += len;
+		start = i + 1;
+	}
+	m[p++] = 0;
+	m[p++] = 0;
+	m[p++] = static_cast<u8>(type);
+	m[p++] = 0;
+	m[p++] = kClassIn;
+	q->len = p;
+	q->type = type;
+	q->answered = false;
+	q->ttl = ~0u;
+	q->result = Result();
+	return true;
+}
+
+// skipName
+// Returns the offset past the name at p, which may end
+// in a compression pointer, or 0 if it runs off the end.
+u64 skipName(const u8 *m, u64 len, u64 p) {
+	while (p < len) {
+		u8 l = m[p];
+		if (l == 0) return p + 1;
+		if ((l & 0xc0) == 0xc0) return p + 2 <= len ? p + 2 : 0;
+		if (l & 0xc0) return 0;
+		p += 1u + l;
+	}
+	return 0;
+}
+
+// take
+// Reads a reply into q if it answers it: the addresses
+// of q's type in the answer section, and for a denial
+// the TTL the authority's SOA gives it, RFC 2308.
+Reply take(const u8 *m, u64 len, Question *q) {
+	if (len < q->len || get16(m) != get16(q->query)) return Reply::kIgnored;
+	uint flags = get16(&m[2]);
+	if (!(flags & kResponse) || get16(&m[4]) != 1) return Reply::kIgnored;
+	// The question comes back as asked, bar letter case.
+	const char *asked = reinterpret_cast<const char *>(&q->query[kHeaderSize]);
+	if (!same(reinterpret_cast<const char *>(&m[kHeaderSize]), asked, q->len - kHeaderSize)) return Reply::kIgnored;
+	uint rcode = flags & kRcode;
+	if (rcode != 0 && rcode != kNxDomain) return Reply::kFailed;
+	uint answers = get16(&m[6]), records = answers + get16(&m[8]), i;
+	u64 p = q->len;
+	for (i = 0; i < records; i++) {
+		p = skipName(m, len, p);
+		if (p == 0 || p + 10 > len) break;
+		uint type = get16(&m[p]), cls = get16(&m[p + 2]), ttl = get32(&m[p + 4]), size = get16(&m[p + 8]);
+		p += 10;
+		if (p + size > len) break;
+		if (cls == kClassIn && i < answers && type == q->type && size == (type == kTypeA ? 4u : 16u)) {
+			Ip ip;
+			ip.family = type == kTypeA ? net::Family::kInet : net::Family::kInet6;
+			memcpy(ip.bytes, &m[p], size);
+			add(&q->result, ip);
+			if (ttl < q->ttl) q->ttl = ttl;
+		} else if (cls == kClassIn && i >= answers && type == kTypeSoa && size >= 20) {
+			uint minimum = get32(&m[p + size - 4]);
+			if (minimum < ttl) ttl = minimum;
+			if (ttl < q->ttl) q->ttl = ttl;
+		}
+		p += size;
+	}
+	q->answered = true;
+	return Reply::kTaken;
+}
+
+// Resolver
+// Files read, servers to ask and the answer cache.
+class Resolver {
+public:
+	void init(const Config &c);
+	int lookup(string name, Result *r);
+private:
+	struct Cached {
+		char name[kMaxName];
+		u64 len;
+		u64 expires; // clock time
+		Result result;
+	};
+
+	void load();
+	int exchange(const net::Addr &server, Question *qs, int n);
+
+	Config c_;
+	bool loaded_ = false;
+	Hosts hosts_;
+	net::Addr servers_[kMaxServers];
+	int nServers_ = 0;
+	int timeout_ = kTimeout;
+	int attempts_ = kAttempts;
+	Cached cache_[kCacheSize];
+};
+
+Resolver resolver;
+
+void Resolver::init(const Config &c) {
+	c_ = c;
+	loaded_ = false;
+}
+
+// load
+// Indexes the hosts file and reads the servers and
+// their timeout and attempts from resolv.conf, asking
+// the local host when it names none, as libc does.
+void Resolver::load() {
+	loaded_ = true;
+	hosts_.load(c_.hosts);
+	char buf[kConfSize];
+	i64 len = 0;
+	int fd = io::open(c_.resolvConf, io::kReadOnly | io::kCloseExec, 0);
+	if (fd >= 0) {
+		len = syscall::read(fd, buf, sizeof buf);
+		syscall::close(fd);
+	}
+	Lines lines(buf, len > 0 ? static_cast<u64>(len) : 0);
+	string w;
+	while (lines.next()) {
+		if (!lines.word(&w)) continue;
+		if (is(w, "nameserver")) {
+			Ip ip;
+			if (lines.word(&w) && literal(w, &ip) && nServers_ < kMaxServers) servers_[nServers_++] = ip.addr(kDnsPort);
+		} else if (is(w, "options")) {
+			while (lines.word(&w)) {
+				option(w, "timeout:", &timeout_);
+				option(w, "attempts:", &attempts_);
+			}
+		}
+	}
+	if (c_.server.len() != 0) {
+		servers_[0] = c_.server;
+		nServers_ = 1;
+	}
+	if (nServers_ == 0) servers_[nServers_++] = net::Addr::inet(0x7f000001, kDnsPort);
+}
+
+// exchange
+// Sends server the questions still unanswered and reads
+// replies until all are answered, it fails one, or the
+// timeout passes. Returns 0, or the negated errno if the
+// server is unreachable or cannot answer.
+int Resolver::exchange(const net::Addr &server, Question *qs, int n) {
+	net::Socket s = net::Socket::open(server.family(), static_cast<int>(net::Type::kDgram));
+	if (!s.ok()) return s.fd();
+	// Connected, the socket only takes replies from the server.
+	int err = s.connect(server);
+	int i, left = 0;
+	for (i = 0; i < n && err == 0; i++) {
+		if (qs[i].answered) continue;
+		i64 w = syscall::write(s.fd(), qs[i].query, qs[i].len);
+		if (w < 0) err = static_cast<int>(w);
+		left++;
+	}
+	u64 deadline = time::now() + static_cast<u64>(timeout_) * time::kSecond;
+	while (err == 0 && left > 0) {
+		u64 now = time::now();
+		if (now >= deadline) break;
+		io::PollFd fd = {s.fd(), io::kIn, 0};
+		int ready = io::poll(&fd, 1, static_cast<int>((deadline - now + time::kMillisecond - 1) / time::kMillisecond));
+		if (ready < 0 && syscall::err(ready) != syscall::kEIntr) err = ready;
+		if (ready <= 0) continue;
+		u8 m[kMaxMessage];
+		// Anything past what fits is lost, as a truncated
+		// reply's would be; the records read still count.
+		i64 got = syscall::read(s.fd(), m, sizeof m);
+		if (got < 0) {
+			err = static_cast<int>(got);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (qs[i].answered) continue;
+			Reply r = take(m, static_cast<u64>(got), &qs[i]);
+			if (r == Reply::kTaken) left--;
+			if (r == Reply::kFailed) err = -syscall::kEConnRefused;
+			if (r != Reply::kIgnored) break;
+		}
+	}
+	s.close();
+	return err;
+}
+
+int Resolver::lookup(string name, Result *r) {
+	*r = Result();
+	Ip ip;
+	if (literal(name, &ip)) {
+		add(r, ip);
+		return 0;
+	}
+	if (name.len > 0 && name.buf[name.len - 1] == '.') name.len--;
+	if (name.len == 0 || name.len > kMaxName) return -syscall::kENoEnt;
+	if (!loaded_) load();
+	hosts_.find(name, r);
+	if (r->n > 0) {
+		interleave(r);
+		return 0;
+	}
+
+	Cached *c = &cache_[hash(name) % kCacheSize];
+	u64 now = time::now();
+	if (c->len == name.len && c->expires > now && same(c->name, name.buf, name.len)) {
+		*r = c->result;
+		return r->n > 0 ? 0 : -syscall::kENoEnt;
+	}
+
+	Question qs[2];
+	if (!ask(&qs[0], name, kTypeAaaa) || !ask(&qs[1], name, kTypeA)) return -syscall::kENoEnt;
+	int err = -syscall::kETimedOut, a, s;
+	for (a = 0; a < attempts_ && !(qs[0].answered && qs[1].answered); a++) {
+		for (s = 0; s < nServers_ && !(qs[0].answered && qs[1].answered); s++) {
+			int e = exchange(servers_[s], qs, 2);
+			if (e < 0) err = e;
+		}
+	}
+	if (!qs[0].answered && !qs[1].answered) return err;
+
+	uint ttl = ~0u;
+	int q, i;
+	for (q = 0; q < 2; q++) {
+		for (i = 0; i < qs[q].result.n; i++) add(r, qs[q].result.ip[i]);
+		if (qs[q].ttl < ttl) ttl = qs[q].ttl;
+	}
+	interleave(r);
+	// Half an answer is used, but not kept.
+	if (qs[0].answered && qs[1].answered && ttl != ~0u) {
+		memcpy(c->name, name.buf, name.len);
+		c->len = name.len;
+		c->expires = now + static_cast<u64>(ttl) * time::kSecond;
+		c->result = *r;
+	}
+	return r->n > 0 ? 0 : -syscall::kENoEnt;
+}
+} // namespace
+
+// init
+// Sets where lookups look. The files are read by the
+// first lookup of a name that is not an address.
+void init(const Config &c) {
+	resolver.init(c);
+}
+
+// lookup
+// Fills r with the addresses of name, which may also be
+// an IPv4 or IPv6 address. Returns 0, -ENOENT if the name
+// does not exist or has no addresses, or the negated
+// errno of failing to ask.
+int lookup(const char *name, Result *r) {
+	return resolver.lookup(fromNullTermString(name), r);
+}
+
+// parseServer
+// Parses a nameserver as address, address:port for
+// IPv4 or [address]:port for IPv6.
+bool parseServer(const char *s, net::Addr *a) {
+	string str = fromNullTermString(s);
+	u16 port = kDnsPort;
+	u64 i, colons = 0, end = str.len;
+	for (i = 0; i < str.len; i++) {
+		if (str.buf[i] == ':') colons++;
+	}
+	u64 start = 0;
+	if (str.len > 0 && str.buf[0] == '[') {
+		for (end = 1; end < str.len && str.buf[end] != ']'; end++) {}
+		if (end == str.len) return false;
+		start = 1;
+		if (end + 1 < str.len && (str.buf[end + 1] != ':' || !net::parsePort(&str.buf[end + 2], &port))) return false;
+	} else if (colons == 1) {
+		for (end = 0; str.buf[end] != ':'; end++) {}
+		if (!net::parsePort(&str.buf[end + 1], &port)) return false;
+	}
+	Ip ip;
+	if (!literal(string{&str.buf[start], end - start + 1, end - start}, &ip)) return false;
+	*a = ip.addr(port);
+	return true;
+}
+
+// connect
+// Connects a stream socket to port at one of r's
+// addresses, in order: an attempt starts as soon as the
+// one before fails, or kAttemptDelay after it began if
+// it is still pending, and the first to connect wins.
+// setup, if given, runs on each socket before it
+// connects. Returns the connected, blocking socket, or
+// one holding the negated errno of the last failure.
+net::Socket connect(const Result &r, u16 port, int (*setup)(net::Socket, void *), void *arg) {
+	net::Socket socks[kMaxIps];
+	io::PollFd fds[kMaxIps];
+	int started = 0, pending = 0, won = -1, err = -syscall::kENoEnt, i;
+	u64 next = 0;
+	while (won < 0) {
+		u64 now = time::now();
+		if (started < r.n && (pending == 0 || now >= next)) {
+			i = started++;
+			net::Addr a = r.ip[i].addr(port);
+			socks[i] = net::Socket::open(a.family(), static_cast<int>(net::Type::kStream) | static_cast<int>(net::Type::kNonBlock));
+			fds[i] = io::PollFd{-1, io::kOut, 0};
+			int e = socks[i].ok() ? 0 : socks[i].fd();
+			if (e == 0 && setup != nullptr) e = setup(socks[i], arg);
+			if (e == 0) e = socks[i].connect(a);
+			if (e == 0) {
+				won = i;
+			} else if (syscall::err(e) == syscall::kEInProgress) {
+				fds[i].fd = socks[i].fd();
+				pending++;
+				next = now + kAttemptDelay;
+			} else {
+				err = e;
+				if (socks[i].ok()) socks[i].close();
+			}
+			continue;
+		}
+		if (pending == 0) return net::Socket(err);
+		int timeout = started < r.n ? static_cast<int>((next - now + time::kMillisecond - 1) / time::kMillisecond) : -1;
+		int ready = io::poll(fds, static_cast<u64>(started), timeout);
+		if (ready < 0 && syscall::err(ready) != syscall::kEIntr) {
+			err = ready;
+			break;
+		}
+		for (i = 0; i < started && ready > 0 && won < 0; i++) {
+			if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+			int soErr = 0;
+			int e = socks[i].getOpt(net::Level::kSocket, net::Opt::kError, &soErr);
+			if (e == 0 && soErr == 0) {
+				won = i;
+				break;
+			}
+			err = e < 0 ? e : -soErr;
+			socks[i].close();
+			fds[i].fd = -1;
+			pending--;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		if (i != won && fds[i].fd >= 0) socks[i].close();
+	}
+	if (won < 0) return net::Socket(err);
+	int e = socks[won].block();
+	if (e < 0) {
+		socks[won].close();
+		return net::Socket(e);
+	}
+	return socks[won];
+}
+
+} // namespace resolve
@@ -0,0 +1,308 @@
+// Port scan
+// depends on def.h, syscall.cc, mem.cc, string.cc, time.cc, io.cc, net.cc, resolve.cc
+// Zero I/O scan mode: non-blocking connects to every host and
+// port, a window of them in flight at once. Completions are
+// found with epoll and results are printed in probe order, so a
+// sweep is bounded by the window rather than by round trips.
+
+namespace scan {
+
+enum {
+	kMaxConcurrency = 0x4000,
+	kEvents         = 0x100,
+	kOutFlush       = 0x100, // room left in the output buffer before writing it
+	kSpareFds       = 0x10   // descriptors left for stdio, epoll and the resolver
+};
+
+// Config
+// Probes in flight, how long each may take, and whether
+// refused and timed out probes are reported as well.
+class Config {
+public:
+	u64 concurrency = 0x100;
+	u64 timeout = 1000; // milliseconds
+	bool verbose = false;
+};
+
+// Targets
+// Enumerates host and port pairs host by host. Hosts are
+// dotted quads or names with an optional /prefix, ports a comma
+// separated list of ports and lo-hi ranges.
+class Targets {
+public:
+	// init
+	// Returns false if a host or the ports do not parse.
+	bool init(char **hosts, int n, const char *ports);
+
+	// next
+	// Fills the next pair, returns false once done.
+	bool next(uint *ip, u16 *port);
+private:
+	bool host(int h);
+	static bool range(const char **pos, u64 *lo, u64 *hi);
+
+	char **hosts_ = nullptr;
+	int n_ = 0;
+	int host_ = 0;
+	u64 ip_ = 0;   // u64 so a /0 can run past the last address
+	u64 last_ = 0;
+	const char *ports_ = nullptr;
+	const char *pos_ = nullptr;
+	u64 port_ = 1;
+	u64 hi_ = 0;
+};
+
+bool Targets::range(const char **pos, u64 *lo, u64 *hi) {
+	const char *p = *pos;
+	u64 n;
+	for (n = 0; p[n] != '\0' && p[n] != ',' && p[n] != '-'; n++) {}
+	if (!stringAsNum(string{const_cast<char *>(p), n + 1, n}, lo, 10)) return false;
+	*hi = *lo;
+	p += n;
+	if (*p == '-') {
+		p++;
+		for (n = 0; p[n] != '\0' && p[n] != ','; n++) {}
+		if (!stringAsNum(string{const_cast<char *>(p), n + 1, n}, hi, 10)) return false;
+		p += n;
+	}
+	if (*p == ',') p++;
+	*pos = p;
+	return *lo != 0 && *lo <= *hi && *hi <= 0xffff;
+}
+
+bool Targets::host(int h) {
+	string s = fromNullTermString(hosts_[h]);
+	u64 i, prefix = 32;
+	for (i = 0; i < s.len && s.buf[i] != '/'; i++) {}
+	if (i < s.len) {
+		string p = {&s.buf[i + 1], s.len - i, s.len - i - 1};
+		if (!stringAsNum(p, &prefix, 10) || prefix > 32) return false;
+	}
+	// Names take their first IPv4 address; init and the
+	// walk both get here, the second time from the cache.
+	uint ip;
+	if (!net::parseIp(string{s.buf, i + 1, i}, &ip)) {
+		char name[0x100];
+		resolve::Result r;
+		if (i >= sizeof name) return false;
+		memcpy(name, s.buf, i);
+		name[i] = '\0';
+		if (resolve::lookup(name, &r) < 0) return false;
+		int a;
+		for (a = 0; a < r.n && r.ip[a].family != net::Family::kInet; a++) {}
+		if (a == r.n) return false;
+		const u8 *b = r.ip[a].bytes;
+		ip = static_cast<uint>(b[0]) << 24 | static_cast<uint>(b[1]) << 16 | static_cast<uint>(b[2]) << 8 | b[3];
+	}
+	u64 size = 1ull << (32 - prefix);
+	ip_ = ip & ~(size - 1);
+	last_ = ip_ + size - 1;
+	return true;
+}
+
+bool Targets::init(char **hosts, int n, const char *ports) {
+	hosts_ = hosts;
+	n_ = n;
+	ports_ = ports;
+	int h;
+	for (h = 0; h < n; h++) {
+		if (!host(h)) return false;
+	}
+	const char *p = ports;
+	u64 lo, hi;
+	while (*p != '\0') {
+		if (!range(&p, &lo, &hi)) return false;
+	}
+	if (n == 0 || *ports == '\0') return false;
+
+	host_ = 0;
+	host(0);
+	pos_ = ports_;
+	port_ = 1;
+	hi_ = 0;
+	return true;
+}
+
+bool Targets::next(uint *ip, u16 *port) {
+	while (port_ > hi_) {
+		if (*pos_ == '\0') {
+			// Ports done for this address, on to the next.
+			pos_ = ports_;
+			if (++ip_ > last_) {
+				if (++host_ >= n_) return false;
+				host(host_);
+			}
+		}
+		range(&pos_, &port_, &hi_);
+	}
+	*ip = static_cast<uint>(ip_);
+	*port = static_cast<u16>(port_++);
+	return true;
+}
+
+namespace {
+enum class State : u8 {
+	kPending,
+	kOpen,
+	kRefused,
+	kTimeout,
+	kError
+};
+
+class Probe {
+public:
+	net::Socket sock;
+	u64 deadline = 0;
+	uint ip = 0;
+	u16 port = 0;
+	State state = State::kPending;
+	int err = 0;
+};
+
+string putIp(string str, uint ip) {
+	return formatString(str, dec(ip >> 24), '.', dec((ip >> 16) & 0xff), '.', dec((ip >> 8) & 0xff), '.', dec(ip & 0xff));
+}
+
+// report
+// Appends a finished probe's line to out,
+// open probes only unless verbose.
+string report(string out, const Config &c, const Probe *p) {
+	if (p->state != State::kOpen && !c.verbose) return out;
+	const char *states[] = {"pending", "open", "refused", "timeout", "error "};
+	out = formatString(putIp(out, p->ip), ' ', dec(p->port), ' ', states[static_cast<int>(p->state)]);
+	if (p->state == State::kError) out = formatString(out, dec(static_cast<u64>(p->err)));
+	out = formatString(out, '\n');
+	if (out.size - out.len < kOutFlush) out = clearString(writeString(out, kStringFdOut));
+	return out;
+}
+
+// finish
+// Settles a probe, closing its socket,
+// which also takes it out of the epoll set.
+void finish(Probe *p, State s, int err) {
+	p->state = s;
+	p->err = err;
+	p->sock.close();
+}
+
+enum {
+	kNoFile = 7 // RLIMIT_NOFILE
+};
+
+// descriptors
+// Raises the open file limit as far as allowed,
+// returning the number of descriptors it allows.
+u64 descriptors() {
+	syscall::RLimit l;
+	if (syscall::getrlimit(kNoFile, &l) < 0) return kMaxConcurrency;
+	if (l.cur < l.max) {
+		syscall::RLimit raised = {l.max, l.max};
+		if (syscall::setrlimit(kNoFile, &raised) == 0) l.cur = l.max;
+	}
+	return l.cur;
+}
+} // namespace
+
+// run
+// Probes every target, writing one line per open port
+// (every port if verbose) to stdout in target order.
+// Returns the number of open ports or the negated errno.
+i64 run(const Config &c, Targets *t) {
+	u64 window = c.concurrency;
+	if (window == 0) window = 1;
+	if (window > kMaxConcurrency) window = kMaxConcurrency;
+	// Each probe holds a socket. Under a tiny limit running
+	// out is left to the retry below.
+	u64 fds = descriptors();
+	if (fds > 2 * kSpareFds && window > fds - kSpareFds) window = fds - kSpareFds;
+	// Results wait in a ring until everything before them
+	// is done; twice the window keeps one slow probe from
+	// stalling new ones.
+	u64 ring = window * 2;
+	Probe *probes = static_cast<Probe *>(mem::pages(ring * sizeof(Probe)));
+	if (probes == nullptr) return -syscall::kENoMem;
+
+	io::Epoll ep;
+	int err = ep.open();
+	if (err < 0) return err;
+
+	char buf[0x1000];
+	string out = newString(buf, sizeof buf);
+	u64 issued = 0, emitted = 0, inFlight = 0, open = 0;
+	bool more = true;
+	for (;;) {
+		uint ip;
+		u16 port;
+		while (more && inFlight < window && issued - emitted < ring) {
+			net::Socket s = net::Socket::open(net::Family::kInet, static_cast<int>(net::Type::kStream) | static_cast<int>(net::Type::kNonBlock));
+			if (!s.ok()) {
+				// Out of descriptors, until probes in flight end.
+				int e = syscall::err(s.fd());
+				if ((e == syscall::kEMFile || e == syscall::kENFile) && inFlight > 0) break;
+				return s.fd();
+			}
+			if (!(more = t->next(&ip, &port))) {
+				s.close();
+				break;
+			}
+			Probe *p = &probes[issued % ring];
+			*p = Probe();
+			p->ip = ip;
+			p->port = port;
+			p->deadline = time::now() + c.timeout * time::kMillisecond;
+			p->sock = s;
+			int r = p->sock.connect(net::Addr::inet(ip, port));
+			if (r == 0) finish(p, State::kOpen, 0);
+			else if (syscall::err(r) == syscall::kEConnRefused) finish(p, State::kRefused, 0);
+			else if (syscall::err(r) != syscall::kEInProgress) finish(p, State::kError, syscall::err(r));
+			else if ((r = ep.add(p->sock.fd(), io::kOut, issued % ring)) < 0) return r;
+			else inFlight++;
+			issued++;
+		}
+
+		while (emitted < issued && probes[emitted % ring].state != State::kPending) {
+			Probe *p = &probes[emitted % ring];
+			if (p->state == State::kOpen) open++;
+			out = report(out, c, p);
+			emitted++;
+		}
+		if (emitted == issued && !more) break;
+
+		// Probes start in order with equal timeouts, so the
+		// oldest one still pending expires first.
+		u64 now = time::now();
+		u64 deadline = probes[emitted % ring].deadline;
+		int timeout = deadline > now ? static_cast<int>((deadline - now) / time::kMillisecond + 1) : 0;
+		if (inFlight == 0) timeout = 0;
+
+		io::Epoll::Event events[kEvents];
+		int n = ep.wait(events, kEvents, timeout);
+		if (n < 0 && syscall::err(n) != syscall::kEIntr) return n;
+		int i;
+		for (i = 0; i < n; i++) {
+			Probe *p = &probes[events[i].data];
+			if (p->state != State::kPending) continue;
+			int e = 0;
+			p->sock.getOpt(net::Level::kSocket, net::Opt::kError, &e);
+			if (e == 0) finish(p, State::kOpen, 0);
+			else if (e == syscall::kEConnRefused) finish(p, State::kRefused, 0);
+			else finish(p, State::kError, e);
+			inFlight--;
+		}
+
+		now = time::now();
+		u64 j;
+		for (j = emitted; j < issued && probes[j % ring].deadline <= now; j++) {
+			Probe *p = &probes[j % ring];
+			if (p->state != State::kPending) continue;
+			finish(p, State::kTimeout, 0);
+			inFlight--;
+		}
+	}
+	writeString(out, kStringFdOut);
+	ep.close();
+	mem::MMap::unmap(probes, ring * sizeof(Probe));
+	return static_cast<i64>(open);
+}
+
+} // namespace scan
@@ -1,10 +1,7 @@
 // String type
-// depends on def.h, syscall.c, mem.c
+// depends on def.h, syscall.cc, mem.cc
 // Defines string type and related methods.
 
-// TODO: remove mem linkage shim
-void upendMem(void *mem, size_t size);
-
 enum {
 	kStringFdIn,
 	kStringFdOut,
@@ -20,7 +17,7 @@ typedef struct {
 // emptyString, empty string constant
 extern const string emptyString;
 
-const string emptyString = {.size = 0};
+const string emptyString = {nullptr, 0, 0};
 
 // string utility methods
 bool isEmptyString(string str);
@@ -31,9 +28,57 @@ string appendString(string str, char toAppend);
 string subString(string str, u64 start, u64 end);
 string reverseString(string str);
 string numAsString(string str, u64 num, int base);
+bool stringAsNum(string str, u64 *num, int base);
 string clearString(string str);
+string concatString(string str, string other);
 string writeString(string str, int fd);
-string fromNullTermString(char *str);
+string fromNullTermString(const char *str);
+
+// Formatting
+// formatDec and formatHex write the digits of num to out,
+// which must hold 20 and 16 chars, and return how many.
+// decLen and hexLen tell that count beforehand.
+uint decLen(u64 num);
+uint hexLen(u64 num);
+uint formatDec(char *out, u64 num);
+uint formatHex(char *out, u64 num);
+
+// Dec, Hex
+// Number pieces for formatString, right aligned
+// in width by pad characters.
+class Dec {
+public:
+	u64 num;
+	uint width;
+	char pad;
+};
+
+class Hex {
+public:
+	u64 num;
+	uint width;
+	char pad;
+};
+
+Dec dec(u64 num, uint width = 0, char pad = ' ');
+Hex hex(u64 num, uint width = 0, char pad = '0');
+
+// formatString
+// Appends each piece to str in order, straight into
+// its buffer, truncating when there is no room left.
+// Pieces are picked by type at compile time: text, chars,
+// strings, dec() and hex(); anything else, such as a bare
+// integer, does not compile rather than printing wrong.
+//   str = formatString(str, "sent ", dec(n), " bytes\n");
+string formatString(string str, const char *s);
+string formatString(string str, string s);
+string formatString(string str, char c);
+string formatString(string str, Dec d);
+string formatString(string str, Hex h);
+template <typename T>
+string formatString(string str, T piece) = delete;
+template <typename T, typename U, typename... Rest>
+string formatString(string str, T first, U second, Rest... rest);
 
 /* hexDump, hexDumps
  * Utility hex dump function.
@@ -41,31 +86,28 @@ string fromNullTermString(char *str);
  * if less than a quadword exists or it is not aligned.
  */
 void hexDump(void *mem, size_t size);
-void hexDumps(char *prefix, void *mem, size_t size);
+void hexDumps(const char *prefix, void *mem, size_t size);
 
-void hexDumps(char *prefix, void *mem, size_t size) {
+void hexDumps(const char *prefix, void *mem, size_t size) {
 	writeString(fromNullTermString(prefix), 1);
 	hexDump(mem, size);
 	writeString(fromNullTermString("\n"), 1);
 }
 
 void hexDump(void *mem, size_t size) {
-	uint bytes = (uint) (size % sizeof(u64));
+	uint bytes = static_cast<uint>(size % sizeof(u64));
 	size_t big = size / sizeof(u64);
 
 	char buf[0x1000];
-	string str = {
-		.buf  = buf,
-		.size = sizeof buf,
-	};
+	string str = newString(buf, sizeof buf);
 
 	u64 i;
 	for (i = 0; i < big; i++) {
-		str = appendString(numAsString(str, ((u64*)mem)[i], 16), '.');
+		str = appendString(numAsString(str, static_cast<u64*>(mem)[i], 16), '.');
 	}
 
 	for (i = 0; i < bytes; i++) {
-		str = numAsString(str, ((u8*)&((u64*)mem)[big])[i], 16);
+		str = numAsString(str, reinterpret_cast<u8*>(&static_cast<u64*>(mem)[big])[i], 16);
 	}
 
 	writeString(str, 1);
@@ -77,10 +119,7 @@ bool isEmptyString(string str) {
 
 // Makes a new string from a character buffer of some size.
 string newString(char buf[], u64 size) {
-	return (string) {
-		.buf  = buf,
-		.size = size
-	};
+	return string{buf, size, 0};
 }
 
 // Sanity checks, allows every method to return nil on error.
@@ -110,37 +149,190 @@ string appendString(string str, char toAppend) {
 
 string subString(string str, u64 start, u64 end) {
 	if (!_stringOk(str) || end > str.size) return emptyString;
-	return (string){
-		.buf  = &str.buf[start],
-		.size = str.size - start,
-		.len  = end - start
-	};
+	return string{&str.buf[start], str.size - start, end - start};
 }
 
 string reverseString(string str) {
 	if (!_stringOk(str)) return emptyString;
 	// Make use of endianness
-	upendMem(str.buf, str.len);
+	mem::upend(str.buf, str.len);
+	return str;
+}
+
+namespace {
+// Digit pairs 00 through 99, so decimal
+// formatting divides once per two digits.
+const char decPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+const char hexDigits[] = "0123456789abcdef";
+
+// room
+// Chars that can be appended while
+// keeping str.len < str.size.
+u64 room(string str) {
+	return _stringOk(str) ? str.size - str.len - 1 : 0;
+}
+
+string putString(string str, const char *s, u64 n) {
+	if (!_stringOk(str)) return emptyString;
+	if (n > room(str)) n = room(str);
+	// Kept a builtin call so gcc does not inline memcpy here
+	// and warn of quadword reads past a short literal, reads
+	// the length never allows.
+	__builtin_memcpy(&str.buf[str.len], s, n);
+	str.len += n;
 	return str;
 }
 
+string padString(string str, char pad, u64 n) {
+	if (!_stringOk(str)) return emptyString;
+	if (n > room(str)) n = room(str);
+	memset(&str.buf[str.len], pad, n);
+	str.len += n;
+	return str;
+}
+} // namespace
+
+uint decLen(u64 num) {
+	uint len = 1;
+	for (;;) {
+		if (num < 10) return len;
+		if (num < 100) return len + 1;
+		if (num < 1000) return len + 2;
+		if (num < 10000) return len + 3;
+		num /= 10000;
+		len += 4;
+	}
+}
+
+uint hexLen(u64 num) {
+	if (num == 0) return 1;
+	return static_cast<uint>(64 - __builtin_clzll(num) + 3) / 4;
+}
+
+uint formatDec(char *out, u64 num) {
+	uint len = decLen(num);
+	char *p = &out[len];
+	while (num >= 100) {
+		u64 r = (num % 100) * 2;
+		num /= 100;
+		*--p = decPairs[r + 1];
+		*--p = decPairs[r];
+	}
+	if (num >= 10) {
+		*--p = decPairs[num * 2 + 1];
+		*--p = decPairs[num * 2];
+	} else {
+		*--p = static_cast<char>('0' + num);
+	}
+	return len;
+}
+
+uint formatHex(char *out, u64 num) {
+	uint len = hexLen(num);
+	uint i;
+	for (i = 0; i < len; i++) {
+		out[i] = hexDigits[(num >> ((len - 1 - i) * 4)) & 0xf];
+	}
+	return len;
+}
+
+Dec dec(u64 num, uint width, char pad) {
+	return Dec{num, width, pad};
+}
+
+Hex hex(u64 num, uint width, char pad) {
+	return Hex{num, width, pad};
+}
+
+string formatString(string str, const char *s) {
+	u64 n;
+	for (n = 0; s[n] != '\0'; n++) {}
+	return putString(str, s, n);
+}
+
+string formatString(string str, string s) {
+	return putString(str, s.buf, s.len);
+}
+
+string formatString(string str, char c) {
+	return putString(str, &c, 1);
+}
+
+string formatString(string str, Dec d) {
+	uint len = decLen(d.num);
+	str = padString(str, d.pad, d.width > len ? d.width - len : 0);
+	if (room(str) >= len) {
+		str.len += formatDec(&str.buf[str.len], d.num);
+		return str;
+	}
+	char tmp[20];
+	return putString(str, tmp, formatDec(tmp, d.num));
+}
+
+string formatString(string str, Hex h) {
+	uint len = hexLen(h.num);
+	str = padString(str, h.pad, h.width > len ? h.width - len : 0);
+	if (room(str) >= len) {
+		str.len += formatHex(&str.buf[str.len], h.num);
+		return str;
+	}
+	char tmp[16];
+	return putString(str, tmp, formatHex(tmp, h.num));
+}
+
+template <typename T, typename U, typename... Rest>
+string formatString(string str, T first, U second, Rest... rest) {
+	return formatString(formatString(str, first), second, rest...);
+}
+
 string numAsString(string str, u64 num, int base) {
 	if (!_stringOk(str)) return emptyString;
-	char digits[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
-		'a', 'b', 'c', 'd', 'e', 'f'};
 	// Base out of range
 	if (base < 2 || base > 16) return emptyString;
+	if (base == 10) return formatString(str, dec(num));
+	if (base == 16) return formatString(str, hex(num));
 
-	u64 oldlen = str.len;
+	// Other bases fill a scratch buffer from the end.
+	char digits[64];
+	char *p = &digits[sizeof digits];
+	do {
+		*--p = hexDigits[num % static_cast<u64>(base)];
+		num /= static_cast<u64>(base);
+	} while (num != 0);
+	return putString(str, p, static_cast<u64>(&digits[sizeof digits] - p));
+}
 
-	while (num != 0 && !isEmptyString(str)) {
-		str = appendString(str, digits[num % (u64) base]);
-		num /= (u64) base;
+// Parses str as an unsigned number in base,
+// returns false if any character is not a digit.
+bool stringAsNum(string str, u64 *num, int base) {
+	if (str.len == 0 || base < 2 || base > 16) return false;
+	u64 n = 0;
+	u64 i;
+	for (i = 0; i < str.len; i++) {
+		char c = str.buf[i];
+		int d;
+		if (c >= '0' && c <= '9') d = c - '0';
+		else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+		else return false;
+		if (d >= base) return false;
+		// Refuse what does not fit rather than wrap around.
+		if (n > (~0ull - static_cast<u64>(d)) / static_cast<u64>(base)) return false;
+		n = n * static_cast<u64>(base) + static_cast<u64>(d);
 	}
-
-	// Reverse the substring written to.
-	reverseString(subString(str, oldlen, str.len));
-	return str;
+	*num = n;
+	return true;
 }
 
 string clearString(string str) {
@@ -149,20 +341,21 @@ string clearString(string str) {
 	return str;
 }
 
+// Appends other to str, truncating if there is no room.
+string concatString(string str, string other) {
+	return putString(str, other.buf, other.len);
+}
+
 string writeString(string str, int fd) {
 	if (!_stringOk(str)) return emptyString;
 	if (str.len > 0) {
-		syscall(kSyscallWrite, (u64[]){(u64) fd, (u64) str.buf, str.len, 0, 0, 0});
+		syscall::write(fd, str.buf, str.len);
 	}
 	return str;
 }
 
-string fromNullTermString(char *str) {
+string fromNullTermString(const char *str) {
 	u64 i;
 	for (i = 0; str[i] != '\0'; i++) {}
-	return (string){
-		.buf  = str,
-		.size = i + 1,
-		.len  = i
-	};
+	return string{const_cast<char *>(str), i + 1, i};
 }
@@ -50,12 +50,18 @@ void *memset(void *ptr, int value, size_t size) {
 }
 
 // memcpy
+// Copies quadwords, then the remaining bytes.
 // NOTE: defined for linking, introduced by compiler.
 void *memcpy(void *dest, const void *src, size_t n) {
 	const u8 *mem = static_cast<const u8*>(src);
 	u8 *mem2 = static_cast<u8*>(dest);
 	size_t i;
-	for (i = 0; i < n; i++) {
+	for (i = 0; i + sizeof(u64) <= n; i += sizeof(u64)) {
+		u64 word;
+		__builtin_memcpy(&word, &mem[i], sizeof word);
+		__builtin_memcpy(&mem2[i], &word, sizeof word);
+	}
+	for (; i < n; i++) {
 		mem2[i] = mem[i];
 	}
 	return dest;
@@ -72,7 +78,7 @@ void *__dso_handle = nullptr;
 void __cxa_pure_virtual() {
 	// pure virtual function call cannot be made.
 	char error[] = "Unimplemented virtual function called\n";
-	syscall::call(syscall::Call::kWrite, reinterpret_cast<u64>(error), sizeof(error)-1, 0, 0, 0, 0);
+	syscall::write(2, error, sizeof(error)-1);
 }
 
 // __cxa_atexit
@@ -90,7 +96,7 @@ int __cxa_atexit(void (*destructor) (void *), void *arg, void *dso) {
 void __cxa_finalize(void *f) {
 	if (f == nullptr) {
 		// Must be called in reverse order.
-		for (int i = len; i >= 0; i--) {
+		for (int i = len - 1; i >= 0; i--) {
 			exitFuncs[i].call();
 		}
 		len = 0;
@@ -103,4 +109,22 @@ void __cxa_finalize(void *f) {
 		len--;
 	}
 }
+
+// __init_array_start, __init_array_end
+// NOTE: Provided by the linker, bracket the global constructors.
+extern void (*__init_array_start[])(void) __attribute__((weak));
+extern void (*__init_array_end[])(void) __attribute__((weak));
+
+// init, fini
+// Run global constructors before _start's work,
+// and registered destructors after it.
+void init(void) {
+	for (void (**f)(void) = __init_array_start; f < __init_array_end; f++) {
+		(*f)();
+	}
+}
+
+void fini(void) {
+	__cxa_finalize(nullptr);
+}
 } // extern "C"
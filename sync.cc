@@ -0,0 +1,145 @@
+// Synchronization
+// depends on def.h, syscall.cc
+// Mutex, condition variable and once flag on futexes.
+// Uncontended they are a single atomic instruction; only
+// a waiter or the thread waking it enters the kernel.
+
+namespace sync {
+
+enum : int {
+	kWakeAll = 0x7fffffff
+};
+
+namespace {
+enum : int {
+	kFutexWait    = 0,
+	kFutexWake    = 1,
+	kFutexPrivate = 128 // not shared between processes
+};
+} // namespace
+
+// wait, wake
+// Sleeps while *addr is val, wakes up to n sleepers
+// on addr; futexes of this process only.
+
+inline void wait(int *addr, int val) {
+	syscall::futex(addr, kFutexWait | kFutexPrivate, val, nullptr);
+}
+
+inline void wake(int *addr, int n) {
+	syscall::futex(addr, kFutexWake | kFutexPrivate, n, nullptr);
+}
+
+inline int load(const int *addr) {
+	return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+// Mutex
+// Drepper's three state futex lock, from "Futexes Are
+// Tricky": 0 unlocked, 1 locked, 2 locked with waiters.
+// Unlock only wakes when the state says someone sleeps.
+class Mutex {
+public:
+	void lock();
+	void unlock();
+
+	// contended
+	// Locks assuming others wait, as a woken condition
+	// variable waiter must, since it cannot tell.
+	void contended();
+private:
+	int state_ = 0;
+};
+
+void Mutex::lock() {
+	int c = 0;
+	if (__atomic_compare_exchange_n(&state_, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+	if (c != 2) c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		wait(&state_, 2);
+		c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+void Mutex::contended() {
+	while (__atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE) != 0) wait(&state_, 2);
+}
+
+void Mutex::unlock() {
+	if (__atomic_fetch_sub(&state_, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&state_, 0, __ATOMIC_RELEASE);
+		wake(&state_, 1);
+	}
+}
+
+// Lock
+// Holds a mutex for the scope it is declared in.
+class Lock {
+public:
+	explicit Lock(Mutex *m) : m_(m) { m_->lock(); }
+	~Lock() { m_->unlock(); }
+	Lock(const Lock &) = delete;
+	Lock &operator=(const Lock &) = delete;
+private:
+	Mutex *m_;
+};
+
+// CondVar
+// Condition variable as a sequence number. A waiter
+// sleeps only while the number it read before unlocking
+// is current, so a signal between the two is not lost.
+// Wakeups may be spurious; wait in a loop on the condition.
+class CondVar {
+public:
+	void wait(Mutex *m);
+	void signal();
+	void broadcast();
+private:
+	int seq_ = 0;
+};
+
+void CondVar::wait(Mutex *m) {
+	int seq = load(&seq_);
+	m->unlock();
+	sync::wait(&seq_, seq);
+	m->contended();
+}
+
+void CondVar::signal() {
+	__atomic_fetch_add(&seq_, 1, __ATOMIC_RELEASE);
+	wake(&seq_, 1);
+}
+
+void CondVar::broadcast() {
+	__atomic_fetch_add(&seq_, 1, __ATOMIC_RELEASE);
+	wake(&seq_, kWakeAll);
+}
+
+// Once
+// Runs a function once however many threads call it,
+// the others waiting until it has returned.
+class Once {
+public:
+	void call(void (*fn)());
+private:
+	enum : int {
+		kIdle,
+		kRunning,
+		kDone
+	};
+	int state_ = kIdle;
+};
+
+void Once::call(void (*fn)()) {
+	if (load(&state_) == kDone) return;
+	int c = kIdle;
+	if (__atomic_compare_exchange_n(&state_, &c, kRunning, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		fn();
+		__atomic_store_n(&state_, kDone, __ATOMIC_RELEASE);
+		wake(&state_, kWakeAll);
+		return;
+	}
+	while (load(&state_) == kRunning) wait(&state_, kRunning);
+}
+
+} // namespace sync
@@ -1,52 +1,388 @@
 // Syscalls
 // depends on def.h
-// Defines SysCall function and related constants.
+// Defines SysCall function and related constants,
+// and typed wrappers for the calls nc makes.
 
 namespace syscall {
 
+// Syscall ids
+enum class Call : int {
+	kRead           = 0,
+	kWrite          = 1,
+	kClose          = 3,
+	kPoll           = 7,
+	kLSeek          = 8,
+	kMMap           = 9,
+	kMProtect       = 10,
+	kMUnmap         = 11,
+	kRtSigAction    = 13,
+	kPWrite64       = 18,
+	kReadV          = 19,
+	kWriteV         = 20,
+	kSocket         = 41,
+	kConnect        = 42,
+	kSendTo         = 44,
+	kRecvFrom       = 45,
+	kSendMsg        = 46,
+	kRecvMsg        = 47,
+	kShutdown       = 48,
+	kBind           = 49,
+	kListen         = 50,
+	kSetSockOpt     = 54,
+	kGetSockOpt     = 55,
+	kClone          = 56,
+	kFork           = 57,
+	kExit           = 60,
+	kFcntl          = 72,
+	kFTruncate      = 77,
+	kUnlink         = 87,
+	kGetRLimit      = 97,
+	kArchPrctl      = 158,
+	kSetRLimit      = 160,
+	kGetTid         = 186,
+	kFutex          = 202,
+	kFadvise64      = 221,
+	kClockGetTime   = 228,
+	kClockNanosleep = 230,
+	kExitGroup      = 231,
+	kEpollWait      = 232,
+	kEpollCtl       = 233,
+	kOpenAt         = 257,
+	kSplice         = 275,
+	kSyncFileRange  = 277,
+	kFallocate      = 285,
+	kAccept4        = 288,
+	kEpollCreate1   = 291,
+	kPipe2          = 293,
+	kGetRandom      = 318
+};
+
 // System V ABI Section A.2.1
+// One function per arity, so each call only loads the
+// registers it uses; r10, r8 and r9 have no constraint
+// letters and are bound through register variables.
+// The kernel trashes rcx and r11, and may read or write
+// any memory passed to it.
 namespace {
-i64 syscall(int call, u64 p0, u64 p1, u64 p2, u64 p3, u64 p4, u64 p5) {
+inline __attribute__((always_inline)) i64 syscall0(Call id) {
 	i64 ret;
-	__asm__(
-			// work around for lack of constraints for
-			// r8, r9, and r10
-			"movq %[p3], %%r10\n"
-			"movq %[p4], %%r8\n"
-			"movq %[p5], %%r9\n"
-
-			"syscall\n"
-			: "=a"(ret)
-			: "a"(call), "D"(p0), "S"(p1), "d"(p2),
-				[p3] "r"(p3), [p4] "r"(p4), [p5] "r"(p5)
-			: "%r8", "%r9", "%r10",
-				"%rcx", "%r11" // trashed by kernel
-	 );
-	 return ret;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)) : "rcx", "r11", "memory");
+	return ret;
 }
-} // namespace
 
-// Syscall ids
-enum class Call : int {
-	kRead     = 0,
-	kWrite    = 1,
-	kMMap     = 9,
-	kMProtect = 10,
-	kMUnmap   = 11,
-	kSocket   = 41,
-	kConnect  = 42,
-	kFork     = 57,
-	kExit     = 60
-};
+inline __attribute__((always_inline)) i64 syscall1(Call id, u64 p0) {
+	i64 ret;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)), "D"(p0) : "rcx", "r11", "memory");
+	return ret;
+}
 
+inline __attribute__((always_inline)) i64 syscall2(Call id, u64 p0, u64 p1) {
+	i64 ret;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)), "D"(p0), "S"(p1) : "rcx", "r11", "memory");
+	return ret;
+}
+
+inline __attribute__((always_inline)) i64 syscall3(Call id, u64 p0, u64 p1, u64 p2) {
+	i64 ret;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)), "D"(p0), "S"(p1), "d"(p2) : "rcx", "r11", "memory");
+	return ret;
+}
+
+inline __attribute__((always_inline)) i64 syscall4(Call id, u64 p0, u64 p1, u64 p2, u64 p3) {
+	i64 ret;
+	register u64 r10 __asm__("r10") = p3;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)), "D"(p0), "S"(p1), "d"(p2), "r"(r10) : "rcx", "r11", "memory");
+	return ret;
+}
+
+inline __attribute__((always_inline)) i64 syscall5(Call id, u64 p0, u64 p1, u64 p2, u64 p3, u64 p4) {
+	i64 ret;
+	register u64 r10 __asm__("r10") = p3;
+	register u64 r8 __asm__("r8") = p4;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)), "D"(p0), "S"(p1), "d"(p2), "r"(r10), "r"(r8) : "rcx", "r11", "memory");
+	return ret;
+}
+
+inline __attribute__((always_inline)) i64 syscall6(Call id, u64 p0, u64 p1, u64 p2, u64 p3, u64 p4, u64 p5) {
+	i64 ret;
+	register u64 r10 __asm__("r10") = p3;
+	register u64 r8 __asm__("r8") = p4;
+	register u64 r9 __asm__("r9") = p5;
+	__asm__ volatile("syscall" : "=a"(ret) : "a"(static_cast<u64>(id)), "D"(p0), "S"(p1), "d"(p2), "r"(r10), "r"(r8), "r"(r9) : "rcx", "r11", "memory");
+	return ret;
+}
+} // namespace
+
+// call
+// Untyped escape hatch for calls without a wrapper.
 i64 call(enum Call id, u64 p0, u64 p1, u64 p2, u64 p3, u64 p4, u64 p5) {
-	return syscall(static_cast<int>(id), p0, p1, p2, p3, p4, p5);
+	return syscall6(id, p0, p1, p2, p3, p4, p5);
 }
 
+// errno values
+enum : int {
+	kEPerm        = 1,
+	kENoEnt       = 2,
+	kEIntr        = 4,
+	kEAgain       = 11,
+	kENoMem       = 12,
+	kEInval       = 22,
+	kENFile       = 23,
+	kEMFile       = 24,
+	kEBadMsg      = 74,
+	kENoBufs      = 105,
+	kETimedOut    = 110,
+	kEConnRefused = 111,
+	kEInProgress  = 115
+};
+
 // Returns errno value
 int err(i64 n) {
 	if (n > -0x1000 && n < 0) return static_cast<int>(-n);
 	return 0;
 }
 
+// fcntl commands
+enum : int {
+	kFcntlGetFlags = 3,
+	kFcntlSetFlags = 4
+};
+
+// Kernel structures taken by the wrappers below.
+
+struct IoVec {
+	void *base;
+	u64 len;
+};
+
+struct MsgHdr {
+	void *name;
+	uint namelen;
+	IoVec *iov;
+	u64 iovlen;
+	void *control;
+	u64 controllen;
+	int flags;
+};
+
+struct PollFd {
+	int fd;
+	i16 events;
+	i16 revents;
+};
+
+struct EpollEvent {
+	uint events;
+	u64 data;
+} __attribute__((packed));
+
+struct Timespec {
+	i64 sec;
+	i64 nsec;
+};
+
+struct RLimit {
+	u64 cur;
+	u64 max;
+};
+
+// Typed wrappers
+// Each wraps the syscall of the same name, see its man page.
+// Results are the syscall's, or the negated errno on failure.
+
+namespace {
+// arg
+// Widens a wrapper's typed argument to a register.
+inline u64 arg(int v) { return static_cast<u64>(v); }
+inline u64 arg(uint v) { return v; }
+inline u64 arg(u64 v) { return v; }
+inline u64 arg(const void *p) { return reinterpret_cast<u64>(p); }
+} // namespace
+
+inline i64 read(int fd, void *buf, u64 len) {
+	return syscall3(Call::kRead, arg(fd), arg(buf), len);
+}
+
+inline i64 write(int fd, const void *buf, u64 len) {
+	return syscall3(Call::kWrite, arg(fd), arg(buf), len);
+}
+
+inline i64 readv(int fd, const IoVec *iov, int n) {
+	return syscall3(Call::kReadV, arg(fd), arg(iov), arg(n));
+}
+
+inline i64 writev(int fd, const IoVec *iov, int n) {
+	return syscall3(Call::kWriteV, arg(fd), arg(iov), arg(n));
+}
+
+inline int close(int fd) {
+	return static_cast<int>(syscall1(Call::kClose, arg(fd)));
+}
+
+inline int poll(PollFd *fds, u64 n, int timeout) {
+	return static_cast<int>(syscall3(Call::kPoll, arg(fds), n, arg(timeout)));
+}
+
+inline i64 lseek(int fd, u64 offset, int whence) {
+	return syscall3(Call::kLSeek, arg(fd), offset, arg(whence));
+}
+
+inline i64 pwrite(int fd, const void *buf, u64 len, u64 offset) {
+	return syscall4(Call::kPWrite64, arg(fd), arg(buf), len, offset);
+}
+
+inline int ftruncate(int fd, u64 len) {
+	return static_cast<int>(syscall2(Call::kFTruncate, arg(fd), len));
+}
+
+inline int fallocate(int fd, int mode, u64 offset, u64 len) {
+	return static_cast<int>(syscall4(Call::kFallocate, arg(fd), arg(mode), offset, len));
+}
+
+inline int syncFileRange(int fd, u64 offset, u64 len, uint flags) {
+	return static_cast<int>(syscall4(Call::kSyncFileRange, arg(fd), offset, len, arg(flags)));
+}
+
+inline int fadvise(int fd, u64 offset, u64 len, int advice) {
+	return static_cast<int>(syscall4(Call::kFadvise64, arg(fd), offset, len, arg(advice)));
+}
+
+inline int getrlimit(int resource, RLimit *limit) {
+	return static_cast<int>(syscall2(Call::kGetRLimit, arg(resource), arg(limit)));
+}
+
+inline int setrlimit(int resource, const RLimit *limit) {
+	return static_cast<int>(syscall2(Call::kSetRLimit, arg(resource), arg(limit)));
+}
+
+inline i64 getrandom(void *buf, u64 len, int flags) {
+	return syscall3(Call::kGetRandom, arg(buf), len, arg(flags));
+}
+
+inline i64 mmap(void *addr, u64 len, int prot, int flags, int fd, u64 offset) {
+	return syscall6(Call::kMMap, arg(addr), len, arg(prot), arg(flags), arg(fd), offset);
+}
+
+inline int munmap(void *addr, u64 len) {
+	return static_cast<int>(syscall2(Call::kMUnmap, arg(addr), len));
+}
+
+inline int mprotect(void *addr, u64 len, int prot) {
+	return static_cast<int>(syscall3(Call::kMProtect, arg(addr), len, arg(prot)));
+}
+
+inline int rtSigAction(int sig, const void *act, void *old, u64 setSize) {
+	return static_cast<int>(syscall4(Call::kRtSigAction, arg(sig), arg(act), arg(old), setSize));
+}
+
+inline int socket(int family, int type, int protocol) {
+	return static_cast<int>(syscall3(Call::kSocket, arg(family), arg(type), arg(protocol)));
+}
+
+inline int connect(int fd, const void *addr, uint len) {
+	return static_cast<int>(syscall3(Call::kConnect, arg(fd), arg(addr), len));
+}
+
+inline int bind(int fd, const void *addr, uint len) {
+	return static_cast<int>(syscall3(Call::kBind, arg(fd), arg(addr), len));
+}
+
+inline int listen(int fd, int backlog) {
+	return static_cast<int>(syscall2(Call::kListen, arg(fd), arg(backlog)));
+}
+
+inline int accept4(int fd, void *addr, uint *len, int flags) {
+	return static_cast<int>(syscall4(Call::kAccept4, arg(fd), arg(addr), arg(len), arg(flags)));
+}
+
+inline int shutdown(int fd, int how) {
+	return static_cast<int>(syscall2(Call::kShutdown, arg(fd), arg(how)));
+}
+
+inline i64 sendto(int fd, const void *buf, u64 len, int flags, const void *addr, uint alen) {
+	return syscall6(Call::kSendTo, arg(fd), arg(buf), len, arg(flags), arg(addr), alen);
+}
+
+inline i64 recvfrom(int fd, void *buf, u64 len, int flags, void *addr, uint *alen) {
+	return syscall6(Call::kRecvFrom, arg(fd), arg(buf), len, arg(flags), arg(addr), arg(alen));
+}
+
+inline i64 sendmsg(int fd, const MsgHdr *msg, int flags) {
+	return syscall3(Call::kSendMsg, arg(fd), arg(msg), arg(flags));
+}
+
+inline i64 recvmsg(int fd, MsgHdr *msg, int flags) {
+	return syscall3(Call::kRecvMsg, arg(fd), arg(msg), arg(flags));
+}
+
+inline int setsockopt(int fd, int level, int name, const void *value, uint len) {
+	return static_cast<int>(syscall5(Call::kSetSockOpt, arg(fd), arg(level), arg(name), arg(value), len));
+}
+
+inline int getsockopt(int fd, int level, int name, void *value, uint *len) {
+	return static_cast<int>(syscall5(Call::kGetSockOpt, arg(fd), arg(level), arg(name), arg(value), arg(len)));
+}
+
+inline i64 fcntl(int fd, int cmd, u64 value) {
+	return syscall3(Call::kFcntl, arg(fd), arg(cmd), value);
+}
+
+inline int unlink(const char *path) {
+	return static_cast<int>(syscall1(Call::kUnlink, arg(path)));
+}
+
+inline int openat(int dir, const char *path, int flags, int mode) {
+	return static_cast<int>(syscall4(Call::kOpenAt, arg(dir), arg(path), arg(flags), arg(mode)));
+}
+
+inline int archPrctl(int code, const void *addr) {
+	return static_cast<int>(syscall2(Call::kArchPrctl, arg(code), arg(addr)));
+}
+
+inline int gettid() {
+	return static_cast<int>(syscall0(Call::kGetTid));
+}
+
+inline int futex(int *addr, int op, int val, const Timespec *timeout) {
+	return static_cast<int>(syscall4(Call::kFutex, arg(addr), arg(op), arg(val), arg(timeout)));
+}
+
+inline int clockGetTime(int clock, Timespec *ts) {
+	return static_cast<int>(syscall2(Call::kClockGetTime, arg(clock), arg(ts)));
+}
+
+inline int clockNanosleep(int clock, int flags, const Timespec *t, Timespec *rem) {
+	return static_cast<int>(syscall4(Call::kClockNanosleep, arg(clock), arg(flags), arg(t), arg(rem)));
+}
+
+inline int epollCreate1(int flags) {
+	return static_cast<int>(syscall1(Call::kEpollCreate1, arg(flags)));
+}
+
+inline int epollCtl(int ep, int op, int fd, EpollEvent *event) {
+	return static_cast<int>(syscall4(Call::kEpollCtl, arg(ep), arg(op), arg(fd), arg(event)));
+}
+
+inline int epollWait(int ep, EpollEvent *events, int n, int timeout) {
+	return static_cast<int>(syscall4(Call::kEpollWait, arg(ep), arg(events), arg(n), arg(timeout)));
+}
+
+inline i64 splice(int in, i64 *inOff, int out, i64 *outOff, u64 len, uint flags) {
+	return syscall6(Call::kSplice, arg(in), arg(inOff), arg(out), arg(outOff), len, flags);
+}
+
+inline int pipe2(int fds[2], int flags) {
+	return static_cast<int>(syscall2(Call::kPipe2, arg(fds), arg(flags)));
+}
+
+// exit
+// Ends the calling thread only.
+inline void exit(int status) {
+	syscall1(Call::kExit, arg(status));
+}
+
+inline void exitGroup(int status) {
+	syscall1(Call::kExitGroup, arg(status));
+}
+
 } // namespace syscall
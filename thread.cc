@@ -0,0 +1,154 @@
+// Threads
+// depends on def.h, syscall.cc, mem.cc, sync.cc, tls.cc
+// Threads on raw clone, sharing memory, files and signal
+// handlers. Each runs on its own mapped stack with a guard
+// page below it, and its tls block sits above the stack.
+
+namespace thread {
+
+enum : u64 {
+	kStackSize = 0x100000 // mapped lazily, so only what is used costs
+};
+
+namespace {
+enum : u64 {
+	kCloneVm            = 0x100,
+	kCloneFs            = 0x200,
+	kCloneFiles         = 0x400,
+	kCloneSigHand       = 0x800,
+	kCloneThread        = 0x10000,
+	kCloneSysVSem       = 0x40000,
+	kCloneSetTls        = 0x80000,
+	kCloneParentSetTid  = 0x100000,
+	kCloneChildClearTid = 0x200000,
+	kFlags = kCloneVm | kCloneFs | kCloneFiles | kCloneSigHand | kCloneThread |
+		kCloneSysVSem | kCloneSetTls | kCloneParentSetTid | kCloneChildClearTid
+};
+
+enum : int {
+	kFutexWait = 0
+};
+
+tls::Block mainBlock;
+} // namespace
+
+} // namespace thread
+
+// cloneThread
+// clone(flags, stack, ptid, ctid, tls) with the entry and
+// its argument on top of the new stack. The child pops
+// them, leaving the stack aligned for the call, and exits
+// the thread when the entry returns; it never returns here.
+extern "C" i64 cloneThread(u64 flags, void *stack, int *ptid, int *ctid, void *tls);
+__asm__(
+	".text\n"
+	".global cloneThread\n"
+	"cloneThread:\n"
+	"movq %rcx, %r10\n"
+	"movl $56, %eax\n"
+	"syscall\n"
+	"testq %rax, %rax\n"
+	"jnz 1f\n"
+	"xorq %rbp, %rbp\n"
+	"popq %rax\n"
+	"popq %rdi\n"
+	"call *%rax\n"
+	"movl $60, %eax\n"
+	"xorl %edi, %edi\n"
+	"syscall\n"
+	"hlt\n"
+	"1:\n"
+	"ret\n");
+
+namespace thread {
+
+// init
+// Gives the calling, first thread its tls block and
+// turns on the allocator's thread-safe mode; call before
+// starting threads. Returns 0 or the negated errno.
+int init() {
+	int err = tls::install(&mainBlock);
+	if (err < 0) return err;
+	mem::threads();
+	return 0;
+}
+
+// Thread
+// A started thread, which must be joined
+// before the object goes away.
+class Thread {
+public:
+	// start
+	// Runs fn(arg) on a new thread.
+	// Returns 0 or the negated errno.
+	int start(void (*fn)(void *), void *arg);
+
+	// join
+	// Waits for the thread to return and unmaps its stack.
+	void join();
+
+	// done
+	// Reports whether the thread has returned.
+	bool done() const;
+private:
+	static void entry(void *self);
+
+	void (*fn_)(void *) = nullptr;
+	void *arg_ = nullptr;
+	u8 *map_ = nullptr;
+	tls::Block *block_ = nullptr;
+};
+
+// entry
+// First function of a thread; hands its cached
+// memory back before the thread exits.
+void Thread::entry(void *self) {
+	Thread *t = static_cast<Thread *>(self);
+	t->fn_(t->arg_);
+	mem::release();
+}
+
+int Thread::start(void (*fn)(void *), void *arg) {
+	u64 size = mem::pageSize + kStackSize + mem::pageSize;
+	map_ = static_cast<u8 *>(mem::pages(size));
+	if (map_ == nullptr) return -syscall::kENoMem;
+	int err = syscall::mprotect(map_, mem::pageSize, static_cast<int>(mem::MMap::Prot::kNone));
+	if (err < 0) {
+		mem::MMap::unmap(map_, size);
+		map_ = nullptr;
+		return err;
+	}
+	fn_ = fn;
+	arg_ = arg;
+	// The block takes the top page, the stack grows down
+	// from under it to the guard.
+	block_ = reinterpret_cast<tls::Block *>(&map_[size - mem::pageSize]);
+	block_->self = block_;
+	u64 *sp = reinterpret_cast<u64 *>(block_) - 2;
+	sp[0] = reinterpret_cast<u64>(&entry);
+	sp[1] = reinterpret_cast<u64>(this);
+	i64 tid = cloneThread(kFlags, sp, &block_->tid, &block_->tid, block_);
+	if (tid < 0) {
+		mem::MMap::unmap(map_, size);
+		map_ = nullptr;
+		return static_cast<int>(tid);
+	}
+	return 0;
+}
+
+bool Thread::done() const {
+	return sync::load(&block_->tid) == 0;
+}
+
+void Thread::join() {
+	int tid;
+	// The kernel clears the tid and wakes its futex once
+	// the thread is off its stack for good. That wake is not
+	// private, and would miss a private waiter.
+	while ((tid = sync::load(&block_->tid)) != 0) syscall::futex(&block_->tid, kFutexWait, tid, nullptr);
+	mem::MMap::unmap(map_, mem::pageSize + kStackSize + mem::pageSize);
+	map_ = nullptr;
+	block_ = nullptr;
+}
+
+} // namespace thread
@@ -0,0 +1,44 @@
+// Time
+// depends on def.h, syscall.cc
+// Monotonic clock readings for timing and pacing transfers.
+
+namespace time {
+
+// Durations in nanoseconds
+enum : u64 {
+	kNanosecond  = 1,
+	kMicrosecond = 1000 * kNanosecond,
+	kMillisecond = 1000 * kMicrosecond,
+	kSecond      = 1000 * kMillisecond
+};
+
+namespace {
+enum class Clock : int {
+	kRealtime  = 0,
+	kMonotonic = 1
+};
+
+enum : int {
+	kAbsolute = 1 // TIMER_ABSTIME
+};
+} // namespace
+
+// now
+// Returns nanoseconds on the monotonic clock,
+// only meaningful relative to another reading.
+u64 now() {
+	syscall::Timespec ts = {0, 0};
+	syscall::clockGetTime(static_cast<int>(Clock::kMonotonic), &ts);
+	return static_cast<u64>(ts.sec) * kSecond + static_cast<u64>(ts.nsec);
+}
+
+// sleepUntil
+// Sleeps until the monotonic clock reads t. An absolute
+// deadline neither drifts by the time spent setting it
+// nor restarts from scratch after a signal.
+void sleepUntil(u64 t) {
+	syscall::Timespec ts = {static_cast<i64>(t / kSecond), static_cast<i64>(t % kSecond)};
+	while (syscall::clockNanosleep(static_cast<int>(Clock::kMonotonic), kAbsolute, &ts, nullptr) == -syscall::kEIntr) {}
+}
+
+} // namespace time
@@ -0,0 +1,42 @@
+// Thread local storage
+// depends on def.h, syscall.cc
+// Each thread's control block is pointed to by the fs
+// base, set with arch_prctl for the first thread and by
+// clone for the rest. Its first word points at itself,
+// so finding it is one fs relative load.
+
+namespace tls {
+
+// Block
+// Thread control block.
+struct Block {
+	Block *self;
+	int tid;            // set by clone, cleared by the kernel at exit
+	void *cache;        // the allocator's per-thread free lists
+};
+
+namespace {
+enum : int {
+	kSetFs = 0x1002
+};
+} // namespace
+
+// install
+// Points the calling thread's fs base at b.
+// Returns 0 or the negated errno.
+int install(Block *b) {
+	b->self = b;
+	b->tid = syscall::gettid();
+	return syscall::archPrctl(kSetFs, b);
+}
+
+// self
+// Returns the calling thread's block; only valid
+// after install or in a thread started with one.
+inline Block *self() {
+	Block *b;
+	__asm__ volatile("movq %%fs:0, %0" : "=r"(b));
+	return b;
+}
+
+} // namespace tls
@@ -0,0 +1,203 @@
+// Zero copy sends
+// depends on def.h, syscall.cc, mem.cc, io.cc, net.cc
+// Sends large writes with MSG_ZEROCOPY, so the kernel pins
+// the user pages instead of copying them into the socket.
+// The pages must not change until the kernel reports the
+// send complete on the socket error queue, so buffers are
+// handed out from slots that are only recycled then.
+
+namespace zcopy {
+
+enum {
+	kMinSize  = 0x4000, // smaller sends are copied, zerocopy loses there
+	kSlots    = 8,
+	kSlotSize = 0x10000,
+	kMaxIds   = 0x400,  // sends in flight before waiting on completions
+	kCopied   = 0x40    // sends copied in a row before giving up on zerocopy
+};
+
+namespace {
+enum {
+	kMsgDontWait    = 0x40,
+	kMsgErrQueue    = 0x2000,
+	kMsgZeroCopy    = 0x4000000,
+	kOriginZeroCopy = 5,
+	kCodeCopied     = 1
+};
+
+struct CMsgHdr {
+	u64 len;
+	int level;
+	int type;
+};
+
+// sock_extended_err, a completion covers
+// the send ids info through data.
+struct ExtendedErr {
+	uint err;
+	u8 origin;
+	u8 type;
+	u8 code;
+	u8 pad;
+	uint info;
+	uint data;
+};
+} // namespace
+
+// Sender
+// Zero copy send state of one socket.
+class Sender {
+public:
+	Sender() : Sender(net::Socket()) {}
+	explicit Sender(net::Socket s);
+
+	// enable
+	// Turns on SO_ZEROCOPY. On failure, as for unix
+	// sockets, the sender keeps copying and returns the error.
+	int enable();
+	bool enabled() const;
+
+	// buffer
+	// Returns a kSlotSize buffer the kernel no longer
+	// references, waiting for completions if all are in
+	// flight. Returns nullptr if no memory can be mapped.
+	u8 *buffer();
+
+	// send
+	// Sends once from buf, with MSG_ZEROCOPY if it is large
+	// enough. Returns bytes sent or the negated errno.
+	i64 send(const u8 *buf, u64 len);
+
+	// sendAll
+	// Sends all of buf on a blocking socket.
+	// Returns 0 or the negated errno.
+	int sendAll(const u8 *buf, u64 len);
+
+	// reap
+	// Reads completions off the error queue without
+	// blocking, returns how many were read.
+	int reap();
+private:
+	int wait();
+	int slot(const u8 *buf);
+
+	net::Socket sock_;
+	bool on_ = false;
+	uint next_ = 0;           // id of the next zerocopy send
+	uint inFlight_ = 0;
+	uint copied_ = 0;         // sends the kernel copied since the last it did not
+	int last_ = -1;           // slot last handed out
+	i8 slotOf_[kMaxIds] = {}; // slot of each id in flight, -1 for none
+	uint busy_[kSlots] = {};  // ids in flight per slot
+	u8 *slots_[kSlots] = {};
+};
+
+Sender::Sender(net::Socket s) : sock_(s) {}
+
+int Sender::enable() {
+	int err = sock_.setOpt(net::Level::kSocket, net::Opt::kZeroCopy, 1);
+	on_ = err == 0;
+	return err;
+}
+
+bool Sender::enabled() const {
+	return on_;
+}
+
+int Sender::slot(const u8 *buf) {
+	int k;
+	for (k = 0; k < kSlots; k++) {
+		if (slots_[k] != nullptr && buf >= slots_[k] && buf < slots_[k] + kSlotSize) return k;
+	}
+	return -1;
+}
+
+// wait
+// Blocks until the error queue has something;
+// poll always reports errors, ask for nothing else.
+int Sender::wait() {
+	io::PollFd fd = {sock_.fd(), 0, 0};
+	int r = io::poll(&fd, 1, -1);
+	return r < 0 ? r : 0;
+}
+
+int Sender::reap() {
+	int reaped = 0;
+	for (;;) {
+		u64 control[8];
+		syscall::MsgHdr msg = {nullptr, 0, nullptr, 0, control, sizeof control, 0};
+		i64 r = syscall::recvmsg(sock_.fd(), &msg, kMsgErrQueue | kMsgDontWait);
+		if (r < 0) break;
+
+		u8 *p = reinterpret_cast<u8 *>(control);
+		u8 *end = p + msg.controllen;
+		while (p + sizeof(CMsgHdr) <= end) {
+			CMsgHdr *cm = reinterpret_cast<CMsgHdr *>(p);
+			if (cm->len < sizeof(CMsgHdr)) break;
+			ExtendedErr *ee = reinterpret_cast<ExtendedErr *>(p + sizeof(CMsgHdr));
+			if (ee->origin == kOriginZeroCopy && ee->err == 0) {
+				uint id;
+				for (id = ee->info; id != ee->data + 1; id++) {
+					i8 k = slotOf_[id % kMaxIds];
+					if (k >= 0) busy_[k]--;
+					inFlight_--;
+				}
+				// The kernel copied after all, as over loopback.
+				// One copy can be a passing condition; a run of
+				// them means plain sends are cheaper from here on.
+				if (ee->code & kCodeCopied) copied_ += ee->data - ee->info + 1;
+				else copied_ = 0;
+				if (copied_ >= kCopied) on_ = false;
+				reaped++;
+			}
+			p += mem::align(cm->len, sizeof(u64));
+		}
+	}
+	return reaped;
+}
+
+u8 *Sender::buffer() {
+	int k = (last_ + 1) % kSlots;
+	while (busy_[k] > 0) {
+		if (reap() == 0 && wait() < 0) return nullptr;
+	}
+	if (slots_[k] == nullptr) {
+		slots_[k] = static_cast<u8 *>(mem::pages(kSlotSize));
+		if (slots_[k] == nullptr) return nullptr;
+	}
+	last_ = k;
+	return slots_[k];
+}
+
+i64 Sender::send(const u8 *buf, u64 len) {
+	if (!on_ || len < kMinSize) {
+		return syscall::sendto(sock_.fd(), buf, len, 0, nullptr, 0);
+	}
+	while (inFlight_ >= kMaxIds) {
+		if (reap() == 0 && wait() < 0) break;
+	}
+	i64 n = syscall::sendto(sock_.fd(), buf, len, kMsgZeroCopy, nullptr, 0);
+	if (syscall::err(n) == syscall::kENoBufs) {
+		// Out of pinned page accounting, copy this one.
+		return syscall::sendto(sock_.fd(), buf, len, 0, nullptr, 0);
+	}
+	if (n < 0) return n;
+	int k = slot(buf);
+	slotOf_[next_ % kMaxIds] = static_cast<i8>(k);
+	if (k >= 0) busy_[k]++;
+	next_++;
+	inFlight_++;
+	return n;
+}
+
+int Sender::sendAll(const u8 *buf, u64 len) {
+	while (len > 0) {
+		i64 n = send(buf, len);
+		if (n < 0) return static_cast<int>(n);
+		buf += n;
+		len -= static_cast<u64>(n);
+	}
+	return 0;
+}
+
+} // namespace zcopy